@@ -0,0 +1,163 @@
+#include "cluster_index.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <string_view>
+#include <thread>
+
+#include <cstdio>
+
+std::vector<std::vector<TShortEmbedding*>> TClusterIndex::FindClusters(const std::vector<const TShortEmbedding*>& queries, const size_t limit) const {
+    std::vector<std::vector<TShortEmbedding*>> found;
+    found.reserve(queries.size());
+    for (const TShortEmbedding* query : queries) {
+        found.push_back(FindClusters(*query, limit));
+    }
+    return found;
+}
+
+TVPTreeClusterIndex::TVPTreeClusterIndex(std::vector<TShortEmbedding>& clusters, const TEmbeddingKernels* kernels)
+    : Tree(new TTree(clusters.begin(), clusters.end(), TEmbeddingMetric(kernels)))
+    , ClustersCount(clusters.size())
+{
+}
+
+std::vector<TShortEmbedding*> TVPTreeClusterIndex::FindClusters(const TShortEmbedding& query, const size_t limit) const {
+    if (!ClustersCount) {
+        return {};
+    }
+    double distanceLimit = 10000;
+
+    std::vector<TShortEmbedding*> found = Tree->FindNearbyItems(query, distanceLimit, limit);
+
+    while (found.empty() || found.size() == limit) {
+        while (found.empty()) {
+            found.clear();
+            distanceLimit *= 2;
+            found = Tree->FindNearbyItems(query, distanceLimit, limit);
+        }
+        while (found.size() == limit) {
+            found.clear();
+            distanceLimit *= 0.9;
+            found = Tree->FindNearbyItems(query, distanceLimit, limit);
+        }
+    }
+
+    return found;
+}
+
+// Same radius search for a block of queries; the queries whose radius still
+// has to grow or shrink are re-run together.
+std::vector<std::vector<TShortEmbedding*>> TVPTreeClusterIndex::FindClusters(const std::vector<const TShortEmbedding*>& queries, const size_t limit) const {
+    std::vector<std::vector<TShortEmbedding*>> found(queries.size());
+    if (!ClustersCount) {
+        return found;
+    }
+    std::vector<double> distanceLimits(queries.size(), 10000);
+
+    std::vector<size_t> pending(queries.size());
+    std::iota(pending.begin(), pending.end(), 0);
+
+    bool firstRound = true;
+    while (!pending.empty()) {
+        std::vector<const TShortEmbedding*> roundQueries;
+        std::vector<double> roundLimits;
+        for (const size_t idx : pending) {
+            if (!firstRound) {
+                distanceLimits[idx] *= found[idx].empty() ? 2 : 0.9;
+            }
+            roundQueries.push_back(queries[idx]);
+            roundLimits.push_back(distanceLimits[idx]);
+        }
+        firstRound = false;
+
+        std::vector<std::vector<TShortEmbedding*>> roundFound = Tree->FindNearbyItems(roundQueries, roundLimits, limit);
+
+        std::vector<size_t> nextPending;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            const size_t idx = pending[i];
+            found[idx] = std::move(roundFound[i]);
+            if (found[idx].empty() || found[idx].size() == limit) {
+                nextPending.push_back(idx);
+            }
+        }
+        pending.swap(nextPending);
+    }
+
+    return found;
+}
+
+THnswClusterIndex::THnswClusterIndex(std::vector<TShortEmbedding>& clusters, const TEmbeddingKernels* kernels, const TGraph::TParams& params)
+    : Graph(new TGraph(clusters.begin(), clusters.end(), TEmbeddingMetric(kernels), params))
+{
+    std::hash<std::string_view> hasher;
+    ClustersHash = clusters.size();
+    for (const TShortEmbedding& cluster : clusters) {
+        const std::string_view bytes(reinterpret_cast<const char*>(cluster.Coords.data()), cluster.Coords.size() * sizeof(TCoord));
+        ClustersHash = ClustersHash * 1000003 + hasher(bytes);
+    }
+}
+
+void THnswClusterIndex::Build() {
+    Graph->Build();
+}
+
+bool THnswClusterIndex::Save(const std::string& path) const {
+    // written aside, so that a reload reading path never sees half a graph
+    const std::string tempPath = path + ".tmp";
+    std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&ClustersHash), sizeof(ClustersHash));
+    const bool saved = Graph->Save(out);
+    out.close();
+    if (!saved || out.fail() || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool THnswClusterIndex::Load(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    uint64_t clustersHash = 0;
+    in.read(reinterpret_cast<char*>(&clustersHash), sizeof(clustersHash));
+    return in && clustersHash == ClustersHash && Graph->Load(in);
+}
+
+std::vector<TShortEmbedding*> THnswClusterIndex::FindClusters(const TShortEmbedding& query, const size_t limit) const {
+    return Graph->FindNearestItems(query, limit);
+}
+
+std::unique_ptr<TClusterIndex> MakeClusterIndex(
+    const TClusterIndexParams& params,
+    std::vector<TShortEmbedding>& clusters,
+    const TEmbeddingKernels* kernels,
+    const std::string& indexPath /*= std::string()*/)
+{
+    if (params.Type == "vp-tree") {
+        return std::unique_ptr<TClusterIndex>(new TVPTreeClusterIndex(clusters, kernels));
+    }
+    if (params.Type != "hnsw") {
+        std::cerr << "unknown cluster index type: " << params.Type << " (expected vp-tree or hnsw)" << std::endl;
+        return nullptr;
+    }
+
+    THnswClusterIndex::TGraph::TParams graphParams;
+    graphParams.M = params.HnswM;
+    graphParams.EfConstruction = params.HnswEfConstruction;
+    graphParams.EfSearch = params.HnswEfSearch;
+    graphParams.ThreadsCount = params.HnswThreads ? params.HnswThreads : std::max(1u, std::thread::hardware_concurrency());
+
+    std::unique_ptr<THnswClusterIndex> index(new THnswClusterIndex(clusters, kernels, graphParams));
+    if (!indexPath.empty() && index->Load(indexPath)) {
+        std::cerr << "loaded hnsw index from " << indexPath << std::endl;
+        return index;
+    }
+
+    index->Build();
+    if (!indexPath.empty() && !index->Save(indexPath)) {
+        std::cerr << "cannot save hnsw index to " << indexPath << std::endl;
+    }
+    return index;
+}
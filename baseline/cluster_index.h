@@ -0,0 +1,100 @@
+#pragma once
+
+#include "embedding.h"
+#include "hnsw.h"
+#include "vp_tree.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+struct TShortEmbedding {
+    std::vector<TCoord> Coords;
+    unsigned int Idx = 0;
+};
+
+struct TEmbeddingMetric {
+    const TEmbeddingKernels* Kernels;
+
+    TEmbeddingMetric(const TEmbeddingKernels* kernels = DefaultEmbeddingKernels())
+        : Kernels(kernels)
+    {
+    }
+
+    double Distance (const TShortEmbedding& lhs, const TShortEmbedding& rhs) const {
+        return Kernels->ShortDistance(lhs.Coords, rhs.Coords);
+    }
+
+    // distances from each of the others to item in one kernel call
+    void Distances(const TShortEmbedding& item, const std::vector<const TShortEmbedding*>& others, std::vector<double>& distances) const {
+        std::vector<const TCoord*> coords(others.size());
+        for (size_t i = 0; i < others.size(); ++i) {
+            coords[i] = others[i]->Coords.data();
+        }
+        distances.resize(others.size());
+        Kernels->BatchShortDistances(item.Coords.data(), coords.data(), coords.size(), distances.data());
+    }
+};
+
+// Candidate generator over cluster centers: finds up to limit clusters near
+// a short embedding, in no particular order. Items are owned by the caller
+// and must outlive the index.
+class TClusterIndex {
+public:
+    virtual ~TClusterIndex() = default;
+
+    virtual std::vector<TShortEmbedding*> FindClusters(const TShortEmbedding& query, const size_t limit) const = 0;
+    virtual std::vector<std::vector<TShortEmbedding*>> FindClusters(const std::vector<const TShortEmbedding*>& queries, const size_t limit) const;
+};
+
+// Radius search in a VP tree: the radius grows until something is found and
+// shrinks while the limit is hit, so fewer than limit clusters come back.
+class TVPTreeClusterIndex : public TClusterIndex {
+private:
+    using TTree = TVantagePointTree<TShortEmbedding, TEmbeddingMetric>;
+    std::unique_ptr<TTree> Tree;
+    // no radius finds anything in an empty tree
+    size_t ClustersCount = 0;
+public:
+    TVPTreeClusterIndex(std::vector<TShortEmbedding>& clusters, const TEmbeddingKernels* kernels);
+
+    std::vector<TShortEmbedding*> FindClusters(const TShortEmbedding& query, const size_t limit) const override;
+    std::vector<std::vector<TShortEmbedding*>> FindClusters(const std::vector<const TShortEmbedding*>& queries, const size_t limit) const override;
+};
+
+class THnswClusterIndex : public TClusterIndex {
+public:
+    using TGraph = THnswIndex<TShortEmbedding, TEmbeddingMetric>;
+private:
+    std::unique_ptr<TGraph> Graph;
+    // fingerprint of the centers the graph was built on
+    uint64_t ClustersHash = 0;
+public:
+    THnswClusterIndex(std::vector<TShortEmbedding>& clusters, const TEmbeddingKernels* kernels, const TGraph::TParams& params);
+
+    void Build();
+    bool Save(const std::string& path) const;
+    // false if the file is missing or was built for other centers
+    bool Load(const std::string& path);
+
+    std::vector<TShortEmbedding*> FindClusters(const TShortEmbedding& query, const size_t limit) const override;
+};
+
+struct TClusterIndexParams {
+    // "vp-tree" or "hnsw"
+    std::string Type = "vp-tree";
+
+    size_t HnswM = 16;
+    size_t HnswEfConstruction = 200;
+    size_t HnswEfSearch = 64;
+    // 0 for all hardware threads
+    size_t HnswThreads = 0;
+};
+
+// Builds the index of the given type over clusters; an hnsw graph is loaded
+// from indexPath when it matches the clusters and saved there otherwise.
+std::unique_ptr<TClusterIndex> MakeClusterIndex(
+    const TClusterIndexParams& params,
+    std::vector<TShortEmbedding>& clusters,
+    const TEmbeddingKernels* kernels,
+    const std::string& indexPath = std::string());
@@ -0,0 +1,317 @@
+#include "cluster_storage.h"
+
+#include <iostream>
+
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char StorageMagic[8] = {'S', 'W', 'C', 'L', 'S', 'T', '0', '3'};
+
+    // clusters count, embedding length, block table offset, short embedding
+    // length, centers offset, model hash
+    enum {
+        HeaderFieldsCount = 6
+    };
+
+    enum {
+        BlockAlignment = 4096,
+        PackedBlockAlignment = 64,
+        HeaderSize = sizeof(StorageMagic) + HeaderFieldsCount * sizeof(uint64_t)
+    };
+
+    // a block is laid out as embeddings, key masks, words
+    TClusterBlock MakeBlock(const char* data, const size_t size, const size_t embeddingLength) {
+        TClusterBlock block;
+        block.Size = size;
+        block.Embeddings = reinterpret_cast<const TCoord*>(data);
+        block.KeyMasks = reinterpret_cast<const TKeyMask*>(data + size * embeddingLength * sizeof(TCoord));
+        block.Words = reinterpret_cast<const TWordIndex*>(data + size * (embeddingLength * sizeof(TCoord) + sizeof(TKeyMask)));
+        return block;
+    }
+
+    size_t GetBlockWordSize(const size_t embeddingLength) {
+        return embeddingLength * sizeof(TCoord) + sizeof(TKeyMask) + sizeof(TWordIndex);
+    }
+}
+
+TMemoryClusterStorage::TMemoryClusterStorage(const size_t embeddingLength)
+    : EmbeddingLength(embeddingLength)
+{
+}
+
+void TMemoryClusterStorage::AddBlock(const std::vector<TWordIndex>& words, const std::vector<TKeyMask>& keyMasks, const std::vector<TCoord>& embeddings) {
+    Words.push_back(words);
+    KeyMasks.push_back(keyMasks);
+    Embeddings.push_back(embeddings);
+}
+
+size_t TMemoryClusterStorage::GetClustersCount() const {
+    return Words.size();
+}
+
+size_t TMemoryClusterStorage::GetEmbeddingLength() const {
+    return EmbeddingLength;
+}
+
+TClusterBlock TMemoryClusterStorage::GetBlock(const size_t clusterId) const {
+    TClusterBlock block;
+    block.Words = Words[clusterId].data();
+    block.KeyMasks = KeyMasks[clusterId].data();
+    block.Embeddings = Embeddings[clusterId].data();
+    block.Size = Words[clusterId].size();
+    return block;
+}
+
+bool TMemoryClusterStorage::AddWord(const size_t clusterId, const TWordIndex wordIdx, const TKeyMask keyMask, const TCoord* embedding) {
+    Words[clusterId].push_back(wordIdx);
+    KeyMasks[clusterId].push_back(keyMask);
+    Embeddings[clusterId].insert(Embeddings[clusterId].end(), embedding, embedding + EmbeddingLength);
+    return true;
+}
+
+TMappedClusterStorage::TWriter::TWriter(const std::string& path, const size_t embeddingLength)
+    : Path(path)
+    , TempPath(path + ".tmp")
+    , Out(TempPath, std::ios::binary | std::ios::trunc)
+    , EmbeddingLength(embeddingLength)
+{
+    const std::vector<char> header(BlockAlignment, 0);
+    Out.write(header.data(), header.size());
+}
+
+void TMappedClusterStorage::TWriter::AddBlock(const std::vector<TWordIndex>& words, const std::vector<TKeyMask>& keyMasks, const std::vector<TCoord>& embeddings) {
+    const uint64_t offset = Out.tellp();
+    Out.write(reinterpret_cast<const char*>(embeddings.data()), embeddings.size() * sizeof(TCoord));
+    Out.write(reinterpret_cast<const char*>(keyMasks.data()), keyMasks.size() * sizeof(TKeyMask));
+    Out.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(TWordIndex));
+
+    const uint64_t end = Out.tellp();
+    const std::vector<char> padding((BlockAlignment - end % BlockAlignment) % BlockAlignment, 0);
+    Out.write(padding.data(), padding.size());
+
+    BlockInfos.push_back(offset);
+    BlockInfos.push_back(words.size());
+}
+
+bool TMappedClusterStorage::TWriter::Finish(const std::vector<std::vector<TCoord>>& clusterCenters, const uint64_t modelHash) {
+    const uint64_t tableOffset = Out.tellp();
+    Out.write(reinterpret_cast<const char*>(BlockInfos.data()), BlockInfos.size() * sizeof(uint64_t));
+
+    const uint64_t centersOffset = Out.tellp();
+    const uint64_t shortLength = clusterCenters.empty() ? 0 : clusterCenters.front().size();
+    for (const std::vector<TCoord>& center : clusterCenters) {
+        Out.write(reinterpret_cast<const char*>(center.data()), center.size() * sizeof(TCoord));
+    }
+
+    const uint64_t header[HeaderFieldsCount] = {BlockInfos.size() / 2, EmbeddingLength, tableOffset, shortLength, centersOffset, modelHash};
+    Out.seekp(0);
+    Out.write(StorageMagic, sizeof(StorageMagic));
+    Out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    Out.close();
+
+    // storage mapped from the old file keeps its inode until unmapped
+    if (Out.fail() || std::rename(TempPath.c_str(), Path.c_str()) != 0) {
+        std::remove(TempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+TMappedClusterStorage::~TMappedClusterStorage() {
+    if (Data) {
+        munmap(Data, DataSize);
+    }
+    if (Fd != -1) {
+        close(Fd);
+    }
+}
+
+std::unique_ptr<TMappedClusterStorage> TMappedClusterStorage::Open(const std::string& path, const size_t embeddingLength, const size_t shortEmbeddingLength) {
+    std::unique_ptr<TMappedClusterStorage> storage(new TMappedClusterStorage());
+    storage->Path = path;
+
+    storage->Fd = open(path.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (storage->Fd == -1 || fstat(storage->Fd, &fileStat) != 0 || fileStat.st_size < HeaderSize) {
+        std::cerr << "cannot open cluster storage " << path << std::endl;
+        return nullptr;
+    }
+
+    storage->DataSize = fileStat.st_size;
+    void* data = mmap(nullptr, storage->DataSize, PROT_READ, MAP_SHARED, storage->Fd, 0);
+    if (data == MAP_FAILED) {
+        std::cerr << "cannot map cluster storage " << path << std::endl;
+        return nullptr;
+    }
+    storage->Data = static_cast<char*>(data);
+    storage->PageSize = sysconf(_SC_PAGESIZE);
+
+    // probes jump between clusters, kernel readahead would only waste memory
+    madvise(storage->Data, storage->DataSize, MADV_RANDOM);
+
+    // sizes are checked by division, so that huge counts cannot overflow
+    auto fits = [&](const uint64_t offset, const uint64_t count, const uint64_t itemSize) {
+        return offset <= storage->DataSize && (!itemSize || count <= (storage->DataSize - offset) / itemSize);
+    };
+
+    uint64_t header[HeaderFieldsCount];
+    memcpy(header, storage->Data + sizeof(StorageMagic), sizeof(header));
+    const uint64_t clustersCount = header[0];
+    const uint64_t tableOffset = header[2];
+    const uint64_t centersOffset = header[4];
+    if (memcmp(storage->Data, StorageMagic, sizeof(StorageMagic)) != 0 ||
+        !fits(tableOffset, clustersCount, 2 * sizeof(uint64_t)))
+    {
+        std::cerr << "bad cluster storage " << path << std::endl;
+        return nullptr;
+    }
+    if (header[1] != embeddingLength || (clustersCount && header[3] != shortEmbeddingLength)) {
+        std::cerr << "cluster storage " << path << " has embeddings of lengths " << header[1] << ", " << header[3]
+                  << " instead of " << embeddingLength << ", " << shortEmbeddingLength << std::endl;
+        return nullptr;
+    }
+    if (!fits(centersOffset, clustersCount, shortEmbeddingLength * sizeof(TCoord))) {
+        std::cerr << "truncated cluster centers in cluster storage " << path << std::endl;
+        return nullptr;
+    }
+
+    storage->EmbeddingLength = header[1];
+    storage->ModelHash = header[5];
+    storage->BlockInfos.resize(2 * clustersCount);
+    memcpy(storage->BlockInfos.data(), storage->Data + tableOffset, storage->BlockInfos.size() * sizeof(uint64_t));
+
+    const size_t wordSize = GetBlockWordSize(storage->EmbeddingLength);
+    for (size_t clusterId = 0; clusterId < clustersCount; ++clusterId) {
+        if (!fits(storage->BlockInfos[2 * clusterId], storage->BlockInfos[2 * clusterId + 1], wordSize)) {
+            std::cerr << "block " << clusterId << " is out of cluster storage " << path << std::endl;
+            return nullptr;
+        }
+    }
+
+    storage->ClusterCenters.assign(clustersCount, std::vector<TCoord>(shortEmbeddingLength));
+    for (size_t clusterId = 0; clusterId < clustersCount; ++clusterId) {
+        memcpy(storage->ClusterCenters[clusterId].data(), storage->Data + centersOffset + clusterId * shortEmbeddingLength * sizeof(TCoord), shortEmbeddingLength * sizeof(TCoord));
+    }
+
+    return storage;
+}
+
+size_t TMappedClusterStorage::GetClustersCount() const {
+    return BlockInfos.size() / 2;
+}
+
+size_t TMappedClusterStorage::GetEmbeddingLength() const {
+    return EmbeddingLength;
+}
+
+TClusterBlock TMappedClusterStorage::GetBlock(const size_t clusterId) const {
+    return MakeBlock(Data + BlockInfos[2 * clusterId], BlockInfos[2 * clusterId + 1], EmbeddingLength);
+}
+
+void TMappedClusterStorage::Prefetch(const size_t clusterId) const {
+    const uint64_t offset = BlockInfos[2 * clusterId];
+    const uint64_t size = BlockInfos[2 * clusterId + 1] * GetBlockWordSize(EmbeddingLength);
+    if (!size) {
+        return;
+    }
+
+    const uint64_t begin = offset / PageSize * PageSize;
+    madvise(Data + begin, offset + size - begin, MADV_WILLNEED);
+}
+
+std::unique_ptr<TPackedClusterStorage> TPackedClusterStorage::Make(const TClusterStorage& source, const bool hugePages) {
+    std::unique_ptr<TPackedClusterStorage> storage(new TPackedClusterStorage());
+    storage->EmbeddingLength = source.GetEmbeddingLength();
+
+    const size_t wordSize = GetBlockWordSize(storage->EmbeddingLength);
+    uint64_t size = 0;
+    for (size_t clusterId = 0; clusterId < source.GetClustersCount(); ++clusterId) {
+        const uint64_t blockSize = source.GetBlock(clusterId).Size;
+        storage->BlockInfos.push_back(size);
+        storage->BlockInfos.push_back(blockSize);
+        size += (blockSize * wordSize + PackedBlockAlignment - 1) / PackedBlockAlignment * PackedBlockAlignment;
+    }
+
+    if (!storage->Memory.Allocate(size, hugePages)) {
+        std::cerr << "cannot allocate " << size << " bytes for cluster storage" << std::endl;
+        return nullptr;
+    }
+
+    for (size_t clusterId = 0; clusterId < source.GetClustersCount(); ++clusterId) {
+        const TClusterBlock block = source.GetBlock(clusterId);
+        char* data = storage->Memory.GetData() + storage->BlockInfos[2 * clusterId];
+        const size_t embeddingsSize = block.Size * storage->EmbeddingLength * sizeof(TCoord);
+        memcpy(data, block.Embeddings, embeddingsSize);
+        memcpy(data + embeddingsSize, block.KeyMasks, block.Size * sizeof(TKeyMask));
+        memcpy(data + embeddingsSize + block.Size * sizeof(TKeyMask), block.Words, block.Size * sizeof(TWordIndex));
+    }
+    return storage;
+}
+
+size_t TPackedClusterStorage::GetClustersCount() const {
+    return BlockInfos.size() / 2;
+}
+
+size_t TPackedClusterStorage::GetEmbeddingLength() const {
+    return EmbeddingLength;
+}
+
+TClusterBlock TPackedClusterStorage::GetBlock(const size_t clusterId) const {
+    return MakeBlock(Memory.GetData() + BlockInfos[2 * clusterId], BlockInfos[2 * clusterId + 1], EmbeddingLength);
+}
+
+TOverlayClusterStorage::TOverlayClusterStorage(std::unique_ptr<TClusterStorage> base)
+    : Base(std::move(base))
+    , Copied(Base->GetClustersCount(), 0)
+    , Words(Copied.size())
+    , KeyMasks(Copied.size())
+    , Embeddings(Copied.size())
+{
+}
+
+size_t TOverlayClusterStorage::GetClustersCount() const {
+    return Base->GetClustersCount();
+}
+
+size_t TOverlayClusterStorage::GetEmbeddingLength() const {
+    return Base->GetEmbeddingLength();
+}
+
+TClusterBlock TOverlayClusterStorage::GetBlock(const size_t clusterId) const {
+    if (!Copied[clusterId]) {
+        return Base->GetBlock(clusterId);
+    }
+    TClusterBlock block;
+    block.Words = Words[clusterId].data();
+    block.KeyMasks = KeyMasks[clusterId].data();
+    block.Embeddings = Embeddings[clusterId].data();
+    block.Size = Words[clusterId].size();
+    return block;
+}
+
+void TOverlayClusterStorage::Prefetch(const size_t clusterId) const {
+    if (!Copied[clusterId]) {
+        Base->Prefetch(clusterId);
+    }
+}
+
+bool TOverlayClusterStorage::AddWord(const size_t clusterId, const TWordIndex wordIdx, const TKeyMask keyMask, const TCoord* embedding) {
+    const size_t embeddingLength = GetEmbeddingLength();
+    if (!Copied[clusterId]) {
+        const TClusterBlock block = Base->GetBlock(clusterId);
+        Words[clusterId].assign(block.Words, block.Words + block.Size);
+        KeyMasks[clusterId].assign(block.KeyMasks, block.KeyMasks + block.Size);
+        Embeddings[clusterId].assign(block.Embeddings, block.Embeddings + block.Size * embeddingLength);
+        Copied[clusterId] = 1;
+    }
+    Words[clusterId].push_back(wordIdx);
+    KeyMasks[clusterId].push_back(keyMask);
+    Embeddings[clusterId].insert(Embeddings[clusterId].end(), embedding, embedding + embeddingLength);
+    return true;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "embedding.h"
+#include "placement.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include <fstream>
+
+using TWordIndex = unsigned int;
+
+using TKeyMask = uint64_t;
+
+// Words of one cluster together with their cached full-length embeddings,
+// word i owns Embeddings[i * EmbeddingLength, (i + 1) * EmbeddingLength)
+// and KeyMasks[i], the set of key ids below 64 its key path visits.
+struct TClusterBlock {
+    const TWordIndex* Words = nullptr;
+    const TKeyMask* KeyMasks = nullptr;
+    const TCoord* Embeddings = nullptr;
+    size_t Size = 0;
+};
+
+class TClusterStorage {
+public:
+    virtual ~TClusterStorage() = default;
+
+    virtual size_t GetClustersCount() const = 0;
+    virtual size_t GetEmbeddingLength() const = 0;
+
+    virtual TClusterBlock GetBlock(const size_t clusterId) const = 0;
+
+    // hint that the block will be probed soon
+    virtual void Prefetch(const size_t /*clusterId*/) const {
+    }
+
+    // appends a word to the block, false if the storage is read-only; see
+    // TOverlayClusterStorage for adding to those
+    virtual bool AddWord(const size_t /*clusterId*/, const TWordIndex /*wordIdx*/, const TKeyMask /*keyMask*/, const TCoord* /*embedding*/) {
+        return false;
+    }
+};
+
+class TMemoryClusterStorage : public TClusterStorage {
+private:
+    size_t EmbeddingLength;
+    std::vector<std::vector<TWordIndex>> Words;
+    std::vector<std::vector<TKeyMask>> KeyMasks;
+    std::vector<std::vector<TCoord>> Embeddings;
+public:
+    TMemoryClusterStorage(const size_t embeddingLength);
+
+    void AddBlock(const std::vector<TWordIndex>& words, const std::vector<TKeyMask>& keyMasks, const std::vector<TCoord>& embeddings);
+
+    size_t GetClustersCount() const override;
+    size_t GetEmbeddingLength() const override;
+
+    TClusterBlock GetBlock(const size_t clusterId) const override;
+    bool AddWord(const size_t clusterId, const TWordIndex wordIdx, const TKeyMask keyMask, const TCoord* embedding) override;
+};
+
+// Cluster blocks in a file mapped into memory: only the block table stays
+// resident, blocks are paged in when probed. Every block starts on its own
+// page so that prefetching one cluster never drags in its neighbours. The
+// file also keeps the cluster centers and a hash of the words and layout it
+// was built for, so a later run can open it instead of clustering again.
+class TMappedClusterStorage : public TClusterStorage {
+public:
+    // Writes the file aside and renames it over path on Finish, so that
+    // storage still mapped from an older file at path stays intact.
+    class TWriter {
+    private:
+        std::string Path;
+        std::string TempPath;
+        std::ofstream Out;
+        size_t EmbeddingLength;
+        std::vector<uint64_t> BlockInfos;
+    public:
+        TWriter(const std::string& path, const size_t embeddingLength);
+
+        void AddBlock(const std::vector<TWordIndex>& words, const std::vector<TKeyMask>& keyMasks, const std::vector<TCoord>& embeddings);
+        bool Finish(const std::vector<std::vector<TCoord>>& clusterCenters, const uint64_t modelHash);
+    };
+private:
+    std::string Path;
+    size_t EmbeddingLength = 0;
+    std::vector<uint64_t> BlockInfos;
+    uint64_t ModelHash = 0;
+    std::vector<std::vector<TCoord>> ClusterCenters;
+
+    int Fd = -1;
+    char* Data = nullptr;
+    size_t DataSize = 0;
+    size_t PageSize = 4096;
+private:
+    TMappedClusterStorage() = default;
+public:
+    ~TMappedClusterStorage();
+
+    // nullptr, with the reason reported, for files that are truncated,
+    // corrupt or built for other embedding lengths
+    static std::unique_ptr<TMappedClusterStorage> Open(const std::string& path, const size_t embeddingLength, const size_t shortEmbeddingLength);
+
+    const std::string& GetPath() const {
+        return Path;
+    }
+
+    uint64_t GetModelHash() const {
+        return ModelHash;
+    }
+
+    const std::vector<std::vector<TCoord>>& GetClusterCenters() const {
+        return ClusterCenters;
+    }
+
+    size_t GetClustersCount() const override;
+    size_t GetEmbeddingLength() const override;
+
+    TClusterBlock GetBlock(const size_t clusterId) const override;
+    void Prefetch(const size_t clusterId) const override;
+};
+
+// Read-only copy of another storage packed into one region, optionally on
+// huge pages. Built by a thread pinned to some NUMA node, the pages land on
+// that node.
+class TPackedClusterStorage : public TClusterStorage {
+private:
+    size_t EmbeddingLength = 0;
+    std::vector<uint64_t> BlockInfos;
+    TModelMemory Memory;
+private:
+    TPackedClusterStorage() = default;
+public:
+    static std::unique_ptr<TPackedClusterStorage> Make(const TClusterStorage& source, const bool hugePages);
+
+    const TModelMemory& GetMemory() const {
+        return Memory;
+    }
+
+    size_t GetClustersCount() const override;
+    size_t GetEmbeddingLength() const override;
+
+    TClusterBlock GetBlock(const size_t clusterId) const override;
+};
+
+// Writable layer over a read-only storage: the first word added to a
+// cluster copies its block into memory, later ones are appended there.
+// Clusters nobody added to are still read from the base storage.
+class TOverlayClusterStorage : public TClusterStorage {
+private:
+    std::unique_ptr<TClusterStorage> Base;
+    std::vector<char> Copied;
+    std::vector<std::vector<TWordIndex>> Words;
+    std::vector<std::vector<TKeyMask>> KeyMasks;
+    std::vector<std::vector<TCoord>> Embeddings;
+public:
+    explicit TOverlayClusterStorage(std::unique_ptr<TClusterStorage> base);
+
+    const TClusterStorage& GetBase() const {
+        return *Base;
+    }
+
+    size_t GetClustersCount() const override;
+    size_t GetEmbeddingLength() const override;
+
+    TClusterBlock GetBlock(const size_t clusterId) const override;
+    void Prefetch(const size_t clusterId) const override;
+    bool AddWord(const size_t clusterId, const TWordIndex wordIdx, const TKeyMask keyMask, const TCoord* embedding) override;
+};
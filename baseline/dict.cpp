@@ -1,54 +1,488 @@
 #include "dict.h"
 
-void TDict::UpdateClusterWords(const size_t clustersCount, std::vector<std::vector<TCoord>>& shortWordEmbeddings) {
+#include <fstream>
+#include <limits>
+#include <numeric>
+
+void TDict::SeedClusterCenters(const size_t clustersCount, const std::vector<std::vector<TCoord>>& shortWordEmbeddings, std::mt19937_64& random) {
+    ClusterCenters.clear();
+    if (shortWordEmbeddings.empty()) {
+        return;
+    }
+
+    // k-means++: each next center is sampled with probability proportional
+    // to the squared distance from a word to its nearest chosen center
+    std::vector<double> minSquaredDistances(shortWordEmbeddings.size(), std::numeric_limits<double>::max());
+    size_t nextCenter = random() % shortWordEmbeddings.size();
+    while (ClusterCenters.size() < clustersCount) {
+        ClusterCenters.push_back(shortWordEmbeddings[nextCenter]);
+        const TCoord* center = ClusterCenters.back().data();
+
+        double sumSquaredDistances = 0.;
+        for (size_t wordIdx = 0; wordIdx < shortWordEmbeddings.size(); ++wordIdx) {
+            const double squaredDistance = Kernels->ShortSumSquaredDistances(shortWordEmbeddings[wordIdx].data(), center);
+            minSquaredDistances[wordIdx] = std::min(minSquaredDistances[wordIdx], squaredDistance);
+            sumSquaredDistances += minSquaredDistances[wordIdx];
+        }
+
+        if (sumSquaredDistances <= 0.) {
+            nextCenter = random() % shortWordEmbeddings.size();
+            continue;
+        }
+
+        double threshold = std::uniform_real_distribution<double>(0., sumSquaredDistances)(random);
+        nextCenter = shortWordEmbeddings.size() - 1;
+        for (size_t wordIdx = 0; wordIdx < shortWordEmbeddings.size(); ++wordIdx) {
+            threshold -= minSquaredDistances[wordIdx];
+            if (threshold < 0.) {
+                nextCenter = wordIdx;
+                break;
+            }
+        }
+    }
+}
+
+void TDict::UpdateClusterWords(const size_t clustersCount, std::vector<std::vector<TCoord>>& shortWordEmbeddings, const size_t maxClusterSize /*= 0*/) {
     double sumBestDistances = 0.;
-    ClusterWords.assign(clustersCount, {});
-    for (size_t wordIdx = 0; wordIdx < shortWordEmbeddings.size(); ++wordIdx) {
-        std::pair<size_t, double> bestClusterInfo = GetClusterForShort(shortWordEmbeddings[wordIdx]);
+    if (maxClusterSize) {
+        sumBestDistances = AssignBalanced(clustersCount, shortWordEmbeddings, maxClusterSize);
+    } else {
+        ClusterWords.assign(clustersCount, {});
+        for (size_t wordIdx = 0; wordIdx < shortWordEmbeddings.size(); ++wordIdx) {
+            std::pair<size_t, double> bestClusterInfo = GetClusterForShort(shortWordEmbeddings[wordIdx]);
 
-        ClusterWords[bestClusterInfo.first].push_back(wordIdx);
-        sumBestDistances += bestClusterInfo.second;
+            ClusterWords[bestClusterInfo.first].push_back(wordIdx);
+            sumBestDistances += bestClusterInfo.second;
+        }
     }
     std::cerr << "score: " << (sumBestDistances / shortWordEmbeddings.size()) << std::endl;
 }
 
+double TDict::AssignBalanced(const size_t clustersCount, std::vector<std::vector<TCoord>>& shortWordEmbeddings, const size_t maxClusterSize) {
+    enum {
+        BalancedCandidatesCount = 8
+    };
+
+    const size_t wordsCount = shortWordEmbeddings.size();
+    const size_t capacity = std::max(maxClusterSize, (wordsCount + clustersCount - 1) / clustersCount);
+    const size_t candidatesCount = std::min<size_t>(BalancedCandidatesCount, clustersCount);
+
+    std::vector<std::pair<double, size_t>> distances(clustersCount);
+    std::vector<std::pair<double, size_t>> wordCandidates(wordsCount * candidatesCount);
+    for (size_t wordIdx = 0; wordIdx < wordsCount; ++wordIdx) {
+        for (size_t clusterId = 0; clusterId < clustersCount; ++clusterId) {
+            distances[clusterId] = std::make_pair(Kernels->ShortDistance(shortWordEmbeddings[wordIdx], ClusterCenters[clusterId]), clusterId);
+        }
+        std::partial_sort(distances.begin(), distances.begin() + candidatesCount, distances.end());
+        std::copy(distances.begin(), distances.begin() + candidatesCount, wordCandidates.begin() + wordIdx * candidatesCount);
+    }
+
+    // words closest to some center choose first, so that only the outliers
+    // of overfull clusters get pushed to their next nearest clusters
+    std::vector<size_t> order(wordsCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](const size_t lhs, const size_t rhs) {
+        return wordCandidates[lhs * candidatesCount].first < wordCandidates[rhs * candidatesCount].first;
+    });
+
+    double sumBestDistances = 0.;
+    ClusterWords.assign(clustersCount, {});
+    for (const size_t wordIdx : order) {
+        std::pair<double, size_t> best(std::numeric_limits<double>::max(), clustersCount);
+        for (size_t i = 0; i < candidatesCount; ++i) {
+            const std::pair<double, size_t>& candidate = wordCandidates[wordIdx * candidatesCount + i];
+            if (ClusterWords[candidate.second].size() < capacity) {
+                best = candidate;
+                break;
+            }
+        }
+        if (best.second == clustersCount) {
+            for (size_t clusterId = 0; clusterId < clustersCount; ++clusterId) {
+                if (ClusterWords[clusterId].size() >= capacity) {
+                    continue;
+                }
+                const double distance = Kernels->ShortDistance(shortWordEmbeddings[wordIdx], ClusterCenters[clusterId]);
+                if (distance < best.first) {
+                    best = std::make_pair(distance, clusterId);
+                }
+            }
+        }
+
+        ClusterWords[best.second].push_back(wordIdx);
+        sumBestDistances += best.first;
+    }
+    return sumBestDistances;
+}
+
+void TDict::ReseedEmptyClusters(std::vector<std::vector<TCoord>>& shortWordEmbeddings) {
+    std::vector<size_t> emptyClusters;
+    for (size_t clusterId = 0; clusterId < ClusterWords.size(); ++clusterId) {
+        if (ClusterWords[clusterId].empty()) {
+            emptyClusters.push_back(clusterId);
+        }
+    }
+    if (emptyClusters.empty()) {
+        return;
+    }
+
+    // the words worst represented by their current centers become the new centers
+    std::vector<std::pair<double, std::pair<size_t, size_t>>> farthestWords;
+    for (size_t clusterId = 0; clusterId < ClusterWords.size(); ++clusterId) {
+        const std::vector<TWordIndex>& words = ClusterWords[clusterId];
+        for (size_t position = 0; position < words.size(); ++position) {
+            const double distance = Kernels->ShortDistance(shortWordEmbeddings[words[position]], ClusterCenters[clusterId]);
+            farthestWords.push_back(std::make_pair(distance, std::make_pair(clusterId, position)));
+        }
+    }
+    std::sort(farthestWords.begin(), farthestWords.end(), std::greater<>());
+
+    std::vector<size_t> remainingSizes(ClusterWords.size());
+    for (size_t clusterId = 0; clusterId < ClusterWords.size(); ++clusterId) {
+        remainingSizes[clusterId] = ClusterWords[clusterId].size();
+    }
+
+    std::vector<std::vector<size_t>> movedPositions(ClusterWords.size());
+    size_t reseeded = 0;
+    for (size_t i = 0; i < farthestWords.size() && reseeded < emptyClusters.size(); ++i) {
+        const size_t sourceCluster = farthestWords[i].second.first;
+        const size_t position = farthestWords[i].second.second;
+        if (remainingSizes[sourceCluster] < 2) {
+            continue;
+        }
+        --remainingSizes[sourceCluster];
+
+        const size_t targetCluster = emptyClusters[reseeded++];
+        const TWordIndex wordIdx = ClusterWords[sourceCluster][position];
+        ClusterWords[targetCluster].push_back(wordIdx);
+        ClusterCenters[targetCluster] = shortWordEmbeddings[wordIdx];
+        movedPositions[sourceCluster].push_back(position);
+    }
+
+    for (size_t clusterId = 0; clusterId < ClusterWords.size(); ++clusterId) {
+        std::vector<size_t>& positions = movedPositions[clusterId];
+        std::sort(positions.begin(), positions.end(), std::greater<>());
+        for (const size_t position : positions) {
+            ClusterWords[clusterId].erase(ClusterWords[clusterId].begin() + position);
+        }
+    }
+
+    std::cerr << "reseeded " << reseeded << " empty clusters" << std::endl;
+}
+
 void TDict::UpdateClusterCenters(const size_t clustersCount, std::vector<std::vector<TCoord>>& shortWordEmbeddings) {
     for (size_t clusterId = 0; clusterId < clustersCount; ++clusterId) {
-        std::vector<TMeanCalculator> xCoords(ShortEmbeddingLength);
-        std::vector<TMeanCalculator> yCoords(ShortEmbeddingLength);
+        std::vector<TMeanCalculator> xCoords(Kernels->ShortLength);
+        std::vector<TMeanCalculator> yCoords(Kernels->ShortLength);
 
         for (const size_t wordIdx : ClusterWords[clusterId]) {
-            for (size_t i = 0; i < ShortEmbeddingLength; ++i) {
+            for (size_t i = 0; i < Kernels->ShortLength; ++i) {
                 const TCoord& shortEmbedding = shortWordEmbeddings[wordIdx][i];
                 xCoords[i].Add(shortEmbedding.X);
                 yCoords[i].Add(shortEmbedding.Y);
             }
         }
 
-        for (size_t i = 0; i < ShortEmbeddingLength; ++i) {
+        for (size_t i = 0; i < Kernels->ShortLength; ++i) {
             ClusterCenters[clusterId][i].X = xCoords[i].GetMean();
             ClusterCenters[clusterId][i].Y = yCoords[i].GetMean();
         }
     }
 }
 
-std::vector<TCoord> TDict::ShortenEmbedding(const std::vector<TCoord >& embedding) {
-    std::vector<TCoord> shortEmbedding(ShortEmbeddingLength);
-    for (size_t i = 0; i < ShortEmbeddingLength; ++i) {
-        const size_t start = i * embedding.size() / ShortEmbeddingLength;
-        const size_t end = (i + 1) * embedding.size() / ShortEmbeddingLength;
+void TDict::UpdateClusterCentersMiniBatch(const std::vector<std::vector<TCoord>>& batchShortEmbeddings, std::vector<size_t>& centerCounts) {
+    centerCounts.resize(ClusterCenters.size(), 0);
+
+    // assign the whole batch against the same centers before moving any
+    std::vector<size_t> batchClusters(batchShortEmbeddings.size());
+    for (size_t i = 0; i < batchShortEmbeddings.size(); ++i) {
+        batchClusters[i] = GetClusterForShort(batchShortEmbeddings[i]).first;
+    }
+
+    for (size_t i = 0; i < batchShortEmbeddings.size(); ++i) {
+        std::vector<TCoord>& center = ClusterCenters[batchClusters[i]];
+        const double rate = 1. / ++centerCounts[batchClusters[i]];
+        for (size_t j = 0; j < center.size(); ++j) {
+            center[j].X += (batchShortEmbeddings[i][j].X - center[j].X) * rate;
+            center[j].Y += (batchShortEmbeddings[i][j].Y - center[j].Y) * rate;
+        }
+    }
+}
+
+size_t TDict::RefineClusters(
+    const size_t iterationsCount,
+    const double maxChurn,
+    std::vector<std::vector<TCoord>>& shortWordEmbeddings,
+    const size_t maxClusterSize /*= 0*/,
+    const std::vector<unsigned int>& modelClusters /*= {}*/)
+{
+    const size_t clustersCount = ClusterCenters.size();
+    const size_t wordsCount = shortWordEmbeddings.size();
+
+    UpdateClusterWords(clustersCount, shortWordEmbeddings, maxClusterSize);
+    std::vector<unsigned int> wordClusters = GetAssignedClusters(wordsCount);
+    const std::vector<unsigned int> startClusters = modelClusters.empty() ? wordClusters : modelClusters;
+
+    size_t iteration = 0;
+    while (iteration < iterationsCount) {
+        ++iteration;
+        ReseedEmptyClusters(shortWordEmbeddings);
+        UpdateClusterCenters(clustersCount, shortWordEmbeddings);
+        UpdateClusterWords(clustersCount, shortWordEmbeddings, maxClusterSize);
+
+        std::vector<unsigned int> nextClusters = GetAssignedClusters(wordsCount);
+        size_t churn = 0;
+        for (size_t wordIdx = 0; wordIdx < wordsCount; ++wordIdx) {
+            churn += nextClusters[wordIdx] != wordClusters[wordIdx];
+        }
+        wordClusters.swap(nextClusters);
+        if (churn <= maxChurn * wordsCount) {
+            break;
+        }
+    }
+
+    size_t moved = 0;
+    for (size_t wordIdx = 0; wordIdx < wordsCount; ++wordIdx) {
+        moved += wordClusters[wordIdx] != startClusters[wordIdx];
+    }
+    std::cerr << "refined clusters in " << iteration << " iterations, " << moved << " of " << wordsCount << " words moved" << std::endl;
+    return moved;
+}
+
+std::vector<unsigned int> TDict::GetAssignedClusters(const size_t wordsCount) const {
+    std::vector<unsigned int> wordClusters(wordsCount, 0);
+    for (size_t clusterId = 0; clusterId < ClusterWords.size(); ++clusterId) {
+        for (const TWordIndex wordIdx : ClusterWords[clusterId]) {
+            wordClusters[wordIdx] = clusterId;
+        }
+    }
+    return wordClusters;
+}
+
+namespace {
+    const char CentersMagic[8] = {'S', 'W', 'C', 'E', 'N', 'T', '0', '1'};
+}
+
+bool TDict::SaveClusterCenters(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    const uint64_t header[2] = {ClusterCenters.size(), Kernels->ShortLength};
+    out.write(CentersMagic, sizeof(CentersMagic));
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    for (const std::vector<TCoord>& center : ClusterCenters) {
+        out.write(reinterpret_cast<const char*>(center.data()), center.size() * sizeof(TCoord));
+    }
+    return static_cast<bool>(out);
+}
+
+bool TDict::LoadClusterCenters(const std::string& path, const size_t clustersCount) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        return false;
+    }
+    const uint64_t fileSize = in.tellg();
+    in.seekg(0);
+
+    char magic[sizeof(CentersMagic)];
+    uint64_t header[2];
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!in || !std::equal(magic, magic + sizeof(magic), CentersMagic) || header[1] != Kernels->ShortLength) {
+        std::cerr << "cluster centers " << path << " are corrupt or saved for other short embeddings" << std::endl;
+        return false;
+    }
+    // the count is checked by division, so that a huge one cannot overflow
+    const uint64_t centerSize = header[1] * sizeof(TCoord);
+    const uint64_t centersSize = fileSize - sizeof(CentersMagic) - sizeof(header);
+    if (!header[0] || !centerSize || centersSize % centerSize != 0 || centersSize / centerSize != header[0]) {
+        std::cerr << "cluster centers " << path << " do not match their file size" << std::endl;
+        return false;
+    }
+    if (header[0] != clustersCount) {
+        std::cerr << "cluster centers " << path << " hold " << header[0] << " clusters instead of " << clustersCount << std::endl;
+        return false;
+    }
+
+    std::vector<std::vector<TCoord>> centers(header[0], std::vector<TCoord>(header[1]));
+    for (std::vector<TCoord>& center : centers) {
+        in.read(reinterpret_cast<char*>(center.data()), center.size() * sizeof(TCoord));
+    }
+    if (!in) {
+        return false;
+    }
+    ClusterCenters.swap(centers);
+    return true;
+}
+
+std::vector<TCoord> TDict::ShortenEmbedding(const std::vector<TCoord>& embedding) const {
+    return Kernels->ShortenEmbedding(embedding);
+}
+
+namespace {
+    uint64_t HashKeyPath(const TKeyPath& path) {
+        return std::hash<std::string_view>()(std::string_view(reinterpret_cast<const char*>(path.Keys), path.Size));
+    }
+}
+
+void TDict::GroupWords() {
+    Representatives.clear();
+    NextSibling.clear();
+    GroupsByPath.clear();
+    for (TWordIndex wordIdx = 0; wordIdx < Words.GetSize(); ++wordIdx) {
+        AddToGroup(wordIdx);
+    }
+}
+
+TDict::TWordIndex TDict::AddToGroup(const TWordIndex wordIdx) {
+    const TKeyPath path = GetWordKeys(wordIdx);
+    const TWordIndex representative = FindGroup(path);
+
+    Representatives.resize(wordIdx + 1, NoWord);
+    NextSibling.resize(wordIdx + 1, NoWord);
+    if (representative == NoWord) {
+        Representatives[wordIdx] = wordIdx;
+        GroupsByPath.emplace(HashKeyPath(path), wordIdx);
+        return wordIdx;
+    }
+
+    TWordIndex last = representative;
+    while (NextSibling[last] != NoWord) {
+        last = NextSibling[last];
+    }
+    NextSibling[last] = wordIdx;
+    Representatives[wordIdx] = representative;
+    return representative;
+}
 
-        TMeanCalculator x, y;
-        for (size_t j = start; j < end; ++j) {
-            x.Add(embedding[j].X);
-            y.Add(embedding[j].Y);
+TDict::TWordIndex TDict::FindGroup(const TKeyPath& path) const {
+    const auto range = GroupsByPath.equal_range(HashKeyPath(path));
+    for (auto it = range.first; it != range.second; ++it) {
+        const TKeyPath groupPath = GetWordKeys(it->second);
+        if (groupPath.Size == path.Size && std::equal(path.Keys, path.Keys + path.Size, groupPath.Keys) && !IsGroupRemoved(it->second)) {
+            return it->second;
         }
+    }
+    return NoWord;
+}
+
+void TDict::UpdateClusterEmbeddings() {
+    ClusterEmbeddings.clear();
+    for (const std::vector<TCoord>& clusterCenter : ClusterCenters) {
+        TShortEmbedding clusterEmbedding;
+        clusterEmbedding.Coords = clusterCenter;
+        clusterEmbedding.Idx = ClusterEmbeddings.size();
 
-        shortEmbedding[i].X = x.GetMean();
-        shortEmbedding[i].Y = y.GetMean();
+        ClusterEmbeddings.push_back(clusterEmbedding);
     }
+}
 
-    return shortEmbedding;
+void TDict::RemapClusterWords(const std::vector<TWordIndex>& words) {
+    for (std::vector<TWordIndex>& clusterWords : ClusterWords) {
+        for (TWordIndex& wordIdx : clusterWords) {
+            wordIdx = words[wordIdx];
+        }
+    }
+}
+
+std::vector<TDict::TWordIndex> TDict::GetLiveRepresentatives() const {
+    std::vector<TWordIndex> representatives;
+    for (TWordIndex wordIdx = 0; wordIdx < Representatives.size(); ++wordIdx) {
+        if (IsRepresentative(wordIdx) && !IsGroupRemoved(wordIdx)) {
+            representatives.push_back(wordIdx);
+        }
+    }
+    return representatives;
+}
+
+void TDict::ResetClusterStats(const size_t wordsCount) {
+    Removed.resize(wordsCount, 0);
+    WordClusters.assign(wordsCount, 0);
+    ClusterSums.assign(ClusterCenters.size(), std::vector<TCoord>(Kernels->ShortLength));
+    ClusterSizes.assign(ClusterCenters.size(), 0);
+}
+
+void TDict::UpdateClusterStats(const std::vector<std::vector<TCoord>>& shortWordEmbeddings) {
+    ResetClusterStats(shortWordEmbeddings.size());
+
+    for (size_t clusterId = 0; clusterId < ClusterWords.size(); ++clusterId) {
+        for (const TWordIndex wordIdx : ClusterWords[clusterId]) {
+            if (!IsGroupRemoved(wordIdx)) {
+                AddToClusterStats(wordIdx, clusterId, shortWordEmbeddings[wordIdx]);
+            }
+        }
+    }
+}
+
+void TDict::AddToClusterStats(const TWordIndex wordIdx, const size_t clusterId, const std::vector<TCoord>& shortEmbedding) {
+    if (WordClusters.size() <= wordIdx) {
+        WordClusters.resize(wordIdx + 1, 0);
+        Removed.resize(wordIdx + 1, 0);
+    }
+    WordClusters[wordIdx] = clusterId;
+
+    std::vector<TCoord>& sum = ClusterSums[clusterId];
+    for (size_t i = 0; i < sum.size(); ++i) {
+        sum[i].X += shortEmbedding[i].X;
+        sum[i].Y += shortEmbedding[i].Y;
+    }
+    ++ClusterSizes[clusterId];
+}
+
+void TDict::AddToClusterStorage(const TWordIndex wordIdx, const size_t clusterId, const TKeyMask keyMask, const TCoord* embedding) {
+    auto addWord = [&](std::unique_ptr<TClusterStorage>& storage) {
+        if (storage->AddWord(clusterId, wordIdx, keyMask, embedding)) {
+            return;
+        }
+        std::unique_ptr<TClusterStorage> base = std::move(storage);
+        storage.reset(new TOverlayClusterStorage(std::move(base)));
+        storage->AddWord(clusterId, wordIdx, keyMask, embedding);
+    };
+    addWord(Storage);
+    for (std::unique_ptr<TClusterStorage>& nodeStorage : NodeStorages) {
+        addWord(nodeStorage);
+    }
+    // mapped storage keeps no cluster words in memory
+    if (!ClusterWords.empty()) {
+        ClusterWords[clusterId].push_back(wordIdx);
+    }
+}
+
+void TDict::RemoveFromClusterStats(const TWordIndex wordIdx, const std::vector<TCoord>& shortEmbedding) {
+    const size_t clusterId = WordClusters[wordIdx];
+
+    std::vector<TCoord>& sum = ClusterSums[clusterId];
+    for (size_t i = 0; i < sum.size(); ++i) {
+        sum[i].X -= shortEmbedding[i].X;
+        sum[i].Y -= shortEmbedding[i].Y;
+    }
+    --ClusterSizes[clusterId];
+}
+
+double TDict::GetMaxCenterDrift() const {
+    double maxDrift = 0.;
+    std::vector<TCoord> mean(Kernels->ShortLength);
+    for (size_t clusterId = 0; clusterId < ClusterSums.size(); ++clusterId) {
+        if (!ClusterSizes[clusterId]) {
+            continue;
+        }
+        for (size_t i = 0; i < mean.size(); ++i) {
+            mean[i].X = ClusterSums[clusterId][i].X / ClusterSizes[clusterId];
+            mean[i].Y = ClusterSums[clusterId][i].Y / ClusterSizes[clusterId];
+        }
+        maxDrift = std::max(maxDrift, Kernels->ShortDistance(mean, ClusterCenters[clusterId]));
+    }
+    return maxDrift;
+}
+
+double TDict::GetClusterSizeSkew() const {
+    size_t maxSize = 0;
+    size_t sumSizes = 0;
+    for (const size_t size : ClusterSizes) {
+        maxSize = std::max(maxSize, size);
+        sumSizes += size;
+    }
+    if (!sumSizes) {
+        return 0.;
+    }
+    return (double)maxSize * ClusterSizes.size() / sumSizes;
 }
 
 std::pair<size_t, double> TDict::GetCluster(const std::vector<TCoord>& embedding) const {
@@ -57,9 +491,9 @@ std::pair<size_t, double> TDict::GetCluster(const std::vector<TCoord>& embedding
 
 std::pair<size_t, double> TDict::GetClusterForShort(const std::vector<TCoord>& shortEmbedding) const {
     size_t bestCluster = 0;
-    double bestDistance = Distance(shortEmbedding, ClusterCenters[0]);
+    double bestDistance = Kernels->ShortDistance(shortEmbedding, ClusterCenters[0]);
     for (size_t clusterId = 1; clusterId < ClusterCenters.size(); ++clusterId) {
-        const double distance = Distance(shortEmbedding, ClusterCenters[clusterId]);
+        const double distance = Kernels->ShortDistance(shortEmbedding, ClusterCenters[clusterId]);
         if (distance > bestDistance) {
             continue;
         }
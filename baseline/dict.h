@@ -1,79 +1,178 @@
 #pragma once
 
-#include "vp_tree.h"
+#include "cluster_index.h"
+#include "cluster_storage.h"
+#include "embedding.h"
+#include "pq.h"
+#include "string_pool.h"
 #include "welford.h"
 
 #include <iostream>
 #include <memory>
 
 #include <algorithm>
+#include <random>
 
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include <cmath>
 
-enum {
-    ShortEmbeddingLength = 20
+// Personal words of one user layered over a shared read-only dict. The
+// overlay is small, so it is scanned in full for every swipe and needs no
+// clusters or index of its own.
+struct TDictOverlay {
+    TStringPool Words;
+    std::vector<TCoord> Embeddings;
 };
 
-struct TCoord {
-    double X;
-    double Y;
+using TKeyId = unsigned char;
 
-    TCoord(const double x = 0., const double y = 0.)
-        : X(x)
-        , Y(y)
-    {
-    }
+// A word spelled as dense key ids of some layout; characters missing from
+// the layout are dropped.
+struct TKeyPath {
+    const TKeyId* Keys = nullptr;
+    size_t Size = 0;
 };
 
-static inline double Distance(
-    const std::vector<TCoord>& lhs,
-    const std::vector<TCoord>& rhs)
-{
-    if (lhs.empty()) {
-        return 0.;
+struct TDict {
+    using TWordIndex = ::TWordIndex;
+    const TEmbeddingKernels* Kernels = DefaultEmbeddingKernels();
+
+    // UTF-8 words, candidates refer to them by views into the pool
+    TStringPool Words;
+
+    // key paths of all words for the layout the dict was clustered with,
+    // word i spans [WordKeyOffsets[i], WordKeyOffsets[i + 1])
+    std::vector<TKeyId> WordKeys;
+    std::vector<size_t> WordKeyOffsets;
+
+    // copies of cluster centers the cluster index points into
+    std::vector<TShortEmbedding> ClusterEmbeddings;
+    std::unique_ptr<TClusterIndex> ClusterIndex;
+
+    std::vector<std::vector<TCoord>> ClusterCenters;
+    std::vector<std::vector<TWordIndex>> ClusterWords;
+
+    // cluster words with cached embeddings as probed by the decoder,
+    // either in memory or mapped from disk
+    std::unique_ptr<TClusterStorage> Storage;
+    // read-only replicas of Storage local to NUMA nodes 1, 2, ...; Storage
+    // itself serves node 0 and threads not pinned to any node
+    std::vector<std::unique_ptr<TClusterStorage>> NodeStorages;
+
+    // product-quantized word embeddings, GetSegmentsCount() bytes per word
+    std::unique_ptr<TProductQuantizer> Quantizer;
+    std::vector<unsigned char> WordCodes;
+
+    // words with equal key paths form a group whose geometry is clustered
+    // and scored once through its representative, the first word of the
+    // group in dict order; NextSibling chains the group in dict order
+    static constexpr TWordIndex NoWord = static_cast<TWordIndex>(-1);
+    std::vector<TWordIndex> Representatives;
+    std::vector<TWordIndex> NextSibling;
+    std::unordered_multimap<uint64_t, TWordIndex> GroupsByPath;
+
+    // incremental updates: removed words stay in place as tombstones, sums of
+    // live members' short embeddings show how far centers have drifted
+    std::vector<char> Removed;
+    std::vector<unsigned int> WordClusters;
+    std::vector<std::vector<TCoord>> ClusterSums;
+    std::vector<size_t> ClusterSizes;
+
+    void SeedClusterCenters(const size_t clustersCount, const std::vector<std::vector<TCoord>>& shortWordEmbeddings, std::mt19937_64& random);
+    void UpdateClusterWords(const size_t clustersCount, std::vector<std::vector<TCoord>>& shortWordEmbeddings, const size_t maxClusterSize = 0);
+    void ReseedEmptyClusters(std::vector<std::vector<TCoord>>& shortWordEmbeddings);
+    // copies ClusterCenters to ClusterEmbeddings, the index has to be rebuilt after
+    void UpdateClusterEmbeddings();
+    void UpdateClusterCenters(const size_t clustersCount, std::vector<std::vector<TCoord>>& shortWordEmbeddings);
+    // moves the nearest center towards every word of the batch with a step
+    // of 1 / (number of words the center has absorbed so far)
+    void UpdateClusterCentersMiniBatch(const std::vector<std::vector<TCoord>>& batchShortEmbeddings, std::vector<size_t>& centerCounts);
+    // Lloyd passes from the current centers, stopping early once a pass
+    // moves at most maxChurn of the words to other clusters; clusters keep
+    // their ids. Returns the number of words ending up in another cluster
+    // than in modelClusters, the clusters of the model being refined by
+    // word position, or, if that is empty, than at their nearest center at
+    // the start.
+    size_t RefineClusters(
+        const size_t iterationsCount,
+        const double maxChurn,
+        std::vector<std::vector<TCoord>>& shortWordEmbeddings,
+        const size_t maxClusterSize = 0,
+        const std::vector<unsigned int>& modelClusters = {});
+
+    // centers saved by one build warm-start clustering of the next one;
+    // false if the file is missing, corrupt, saved for other short
+    // embeddings or for another number of clusters
+    bool SaveClusterCenters(const std::string& path) const;
+    bool LoadClusterCenters(const std::string& path, const size_t clustersCount);
+
+    std::vector<TCoord> ShortenEmbedding(const std::vector<TCoord>& embedding) const;
+
+    const TClusterStorage& GetStorage() const {
+        const size_t node = GetThreadNumaNode();
+        return node && node <= NodeStorages.size() ? *NodeStorages[node - 1] : *Storage;
     }
 
-    double sumSquaredDistances = 0.;
-    for (size_t i = 0; i < lhs.size(); ++i) {
-        const double xDiff = lhs[i].X - rhs[i].X;
-        const double yDiff = lhs[i].Y - rhs[i].Y;
+    TKeyPath GetWordKeys(const TWordIndex wordIdx) const {
+        TKeyPath path;
+        path.Keys = WordKeys.data() + WordKeyOffsets[wordIdx];
+        path.Size = WordKeyOffsets[wordIdx + 1] - WordKeyOffsets[wordIdx];
+        return path;
+    }
 
-        const double squaredDistance = xDiff * xDiff + yDiff * yDiff;
+    const unsigned char* GetWordCode(const TWordIndex wordIdx) const {
+        return WordCodes.data() + wordIdx * Quantizer->GetSegmentsCount();
+    }
 
-        sumSquaredDistances += squaredDistance;
+    bool IsRemoved(const TWordIndex wordIdx) const {
+        return wordIdx < Removed.size() && Removed[wordIdx];
     }
-    return sqrt(std::max(0., sumSquaredDistances) / lhs.size());
-}
 
-struct TShortEmbedding {
-    std::vector<TCoord> Coords;
-    unsigned int Idx = 0;
-};
+    // groups all words by their key paths, call after the paths are encoded
+    void GroupWords();
+    // puts an encoded word into the group of its key path, returns the representative
+    TWordIndex AddToGroup(const TWordIndex wordIdx);
+    // a group whose words all got removed is never found again, a word with
+    // its path starts a new group
+    TWordIndex FindGroup(const TKeyPath& path) const;
 
-struct TEmbeddingMetric {
-    static double Distance (const TShortEmbedding& lhs, const TShortEmbedding& rhs) {
-        return ::Distance(lhs.Coords, rhs.Coords);
+    bool IsRepresentative(const TWordIndex wordIdx) const {
+        return Representatives[wordIdx] == wordIdx;
     }
-};
 
-struct TDict {
-    using TWordIndex = unsigned int;
-    std::vector<std::wstring> Words;
+    bool IsGroupRemoved(const TWordIndex representative) const {
+        for (TWordIndex wordIdx = representative; wordIdx != NoWord; wordIdx = NextSibling[wordIdx]) {
+            if (!IsRemoved(wordIdx)) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-    using TDictVPTree = TVantagePointTree<TShortEmbedding, TEmbeddingMetric>;
-    std::unique_ptr<TDictVPTree> ClustersVPTree;
+    // replaces positions in words stored in ClusterWords by the words themselves
+    void RemapClusterWords(const std::vector<TWordIndex>& words);
 
-    std::vector<std::vector<TCoord>> ClusterCenters;
-    std::vector<std::vector<TWordIndex>> ClusterWords;
+    // representatives of groups with live words, in dict order
+    std::vector<TWordIndex> GetLiveRepresentatives() const;
 
-    void UpdateClusterWords(const size_t clustersCount, std::vector<std::vector<TCoord>>& shortWordEmbeddings);
-    void UpdateClusterCenters(const size_t clustersCount, std::vector<std::vector<TCoord>>& shortWordEmbeddings);
+    void ResetClusterStats(const size_t wordsCount);
+    void UpdateClusterStats(const std::vector<std::vector<TCoord>>& shortWordEmbeddings);
+    void AddToClusterStats(const TWordIndex wordIdx, const size_t clusterId, const std::vector<TCoord>& shortEmbedding);
+    // appends the word to the cluster in ClusterWords, the storage and all
+    // of its node replicas, layering read-only storages with an overlay first
+    void AddToClusterStorage(const TWordIndex wordIdx, const size_t clusterId, const TKeyMask keyMask, const TCoord* embedding);
+    void RemoveFromClusterStats(const TWordIndex wordIdx, const std::vector<TCoord>& shortEmbedding);
 
-    static std::vector<TCoord> ShortenEmbedding(const std::vector<TCoord>& embedding);
+    double GetMaxCenterDrift() const;
+    double GetClusterSizeSkew() const;
 
     std::pair<size_t, double> GetCluster(const std::vector<TCoord>& embedding) const;
     std::pair<size_t, double> GetClusterForShort(const std::vector<TCoord>& shortEmbedding) const;
+private:
+    std::vector<unsigned int> GetAssignedClusters(const size_t wordsCount) const;
+    double AssignBalanced(const size_t clustersCount, std::vector<std::vector<TCoord>>& shortWordEmbeddings, const size_t maxClusterSize);
 };
@@ -0,0 +1,162 @@
+#include "dict_set.h"
+
+#include <algorithm>
+
+std::vector<std::pair<double, std::string_view>> TDictSet::GetCandidates(
+    const TKeyboardLayout& layout,
+    const TSwipeEvent& swipeEvent,
+    const TSearchParams& params,
+    TResultCache* cache /*= nullptr*/,
+    const TDictOverlay* overlay /*= nullptr*/) const
+{
+    const std::vector<TCoord> points = layout.MakePoints(swipeEvent);
+
+    // all dictionaries are built with the same kernels
+    TShortEmbedding shortEmbedding;
+    shortEmbedding.Coords = Dicts.front()->ShortenEmbedding(points);
+
+    std::vector<std::pair<double, std::string_view>> candidates;
+    TResultCache::TKey key;
+    if (cache) {
+        key = cache->MakeKey(layout.Id, layout.KeyWidth(), shortEmbedding.Coords);
+    }
+    if (!cache || !cache->Find(key, candidates)) {
+        const TSearchParams dictParams = GetDictParams(params);
+        std::vector<std::vector<std::pair<double, std::string_view>>> dictCandidates(Dicts.size());
+        ParallelFor([&](const size_t dictIdx) {
+            dictCandidates[dictIdx] = layout.GetCandidates(points, shortEmbedding, *Dicts[dictIdx], dictParams);
+            Rerank(dictIdx, points, shortEmbedding, params, dictCandidates[dictIdx]);
+        });
+        for (size_t dictIdx = 0; dictIdx < Dicts.size(); ++dictIdx) {
+            MergeCandidates(candidates, dictCandidates[dictIdx], dictIdx, params.TopSize);
+        }
+        if (cache) {
+            cache->Insert(key, candidates);
+        }
+    }
+
+    if (overlay) {
+        TKeyboardLayout::MergeCandidates(candidates, GetOverlayCandidates(layout, points, shortEmbedding, *overlay, params), params.TopSize);
+    }
+    return candidates;
+}
+
+std::vector<std::vector<std::pair<double, std::string_view>>> TDictSet::GetCandidates(
+    const TKeyboardLayout& layout,
+    const std::vector<TSwipeEvent>& swipeEvents,
+    const TSearchParams& params,
+    TResultCache* cache /*= nullptr*/,
+    const TDictOverlay* overlay /*= nullptr*/) const
+{
+    std::vector<std::vector<std::pair<double, std::string_view>>> results(swipeEvents.size());
+
+    std::vector<std::vector<TCoord>> points(swipeEvents.size());
+    std::vector<TShortEmbedding> shortEmbeddings(swipeEvents.size());
+    std::vector<TResultCache::TKey> keys(cache ? swipeEvents.size() : 0);
+
+    std::vector<size_t> misses;
+    for (size_t i = 0; i < swipeEvents.size(); ++i) {
+        points[i] = layout.MakePoints(swipeEvents[i]);
+        shortEmbeddings[i].Coords = Dicts.front()->ShortenEmbedding(points[i]);
+        if (cache) {
+            keys[i] = cache->MakeKey(layout.Id, layout.KeyWidth(), shortEmbeddings[i].Coords);
+            if (cache->Find(keys[i], results[i])) {
+                continue;
+            }
+        }
+        misses.push_back(i);
+    }
+
+    const TSearchParams dictParams = GetDictParams(params);
+    std::vector<std::vector<std::vector<std::pair<double, std::string_view>>>> dictResults(Dicts.size());
+    ParallelFor([&](const size_t dictIdx) {
+        dictResults[dictIdx] = layout.GetCandidates(points, shortEmbeddings, misses, *Dicts[dictIdx], dictParams);
+        for (size_t i = 0; i < misses.size(); ++i) {
+            Rerank(dictIdx, points[misses[i]], shortEmbeddings[misses[i]], params, dictResults[dictIdx][i]);
+        }
+    });
+
+    for (size_t i = 0; i < misses.size(); ++i) {
+        const size_t idx = misses[i];
+        for (size_t dictIdx = 0; dictIdx < Dicts.size(); ++dictIdx) {
+            MergeCandidates(results[idx], dictResults[dictIdx][i], dictIdx, params.TopSize);
+        }
+        if (cache) {
+            cache->Insert(keys[idx], results[idx]);
+        }
+    }
+
+    if (overlay) {
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            TKeyboardLayout::MergeCandidates(results[i], GetOverlayCandidates(layout, points[i], shortEmbeddings[i], *overlay, params), params.TopSize);
+        }
+    }
+    return results;
+}
+
+size_t TDictSet::GetWordsCount() const {
+    size_t wordsCount = 0;
+    for (const std::unique_ptr<TDict>& dict : Dicts) {
+        wordsCount += dict->Words.GetSize();
+    }
+    return wordsCount;
+}
+
+void TDictSet::ParallelFor(const std::function<void(size_t)>& task) const {
+    if (Pool) {
+        Pool->ParallelFor(Dicts.size(), task);
+        return;
+    }
+    for (size_t dictIdx = 0; dictIdx < Dicts.size(); ++dictIdx) {
+        task(dictIdx);
+    }
+}
+
+TSearchParams TDictSet::GetDictParams(const TSearchParams& params) const {
+    TSearchParams dictParams = params;
+    if (Reranker) {
+        dictParams.TopSize = std::max(params.TopSize, params.RerankCount);
+    }
+    return dictParams;
+}
+
+void TDictSet::Rerank(
+    const size_t dictIdx,
+    const std::vector<TCoord>& points,
+    const TShortEmbedding& shortEmbedding,
+    const TSearchParams& params,
+    std::vector<std::pair<double, std::string_view>>& candidates) const
+{
+    if (Reranker && dictIdx < Extractors.size()) {
+        Reranker->Rerank(*Extractors[dictIdx], points, shortEmbedding, params.ClustersLimit, params.TopSize, candidates);
+    }
+}
+
+std::vector<std::pair<double, std::string_view>> TDictSet::GetOverlayCandidates(
+    const TKeyboardLayout& layout,
+    const std::vector<TCoord>& points,
+    const TShortEmbedding& shortEmbedding,
+    const TDictOverlay& overlay,
+    const TSearchParams& params) const
+{
+    // reranked like the first dictionary, so that merged scores compare;
+    // its extractor finds no clusters for words it does not have
+    std::vector<std::pair<double, std::string_view>> candidates = layout.ScoreOverlay(points, overlay, GetDictParams(params));
+    Rerank(0, points, shortEmbedding, params, candidates);
+    return candidates;
+}
+
+void TDictSet::MergeCandidates(
+    std::vector<std::pair<double, std::string_view>>& candidates,
+    std::vector<std::pair<double, std::string_view>>& dictCandidates,
+    const size_t dictIdx,
+    const size_t topSize) const
+{
+    const double offset = dictIdx < ScoreOffsets.size() ? ScoreOffsets[dictIdx] : 0.;
+    if (offset != 0.) {
+        for (std::pair<double, std::string_view>& candidate : dictCandidates) {
+            candidate.first += offset;
+        }
+    }
+    TKeyboardLayout::MergeCandidates(candidates, dictCandidates, topSize);
+}
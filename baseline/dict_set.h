@@ -0,0 +1,68 @@
+#pragma once
+
+#include "dict.h"
+#include "features.h"
+#include "result_cache.h"
+#include "swipe.h"
+#include "thread_pool.h"
+
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Several dictionaries clustered and indexed each on its own against one
+// layout, e.g. for bilingual users. A swipe is decoded in all of them at
+// once, so latency follows the slowest dictionary rather than their sum;
+// the top lists are merged after adding each dictionary's score offset, a
+// word found in several dictionaries keeps its best score.
+struct TDictSet {
+    std::vector<std::unique_ptr<TDict>> Dicts;
+    // calibrates scores between dictionaries, e.g. a negative offset for a
+    // domain dictionary that should win only on clearly better matches
+    std::vector<double> ScoreOffsets;
+    // decodes dictionaries next to the calling thread, none for one dictionary
+    std::unique_ptr<TThreadPool> Pool;
+    // rescores each dictionary's top list before the merge, see
+    // TSearchParams::RerankCount; one extractor per dictionary
+    std::unique_ptr<TLinearReranker> Reranker;
+    std::vector<std::unique_ptr<TFeatureExtractor>> Extractors;
+
+    // The cache holds merged results of the dictionaries, overlay words are
+    // merged in afterwards as with a single dictionary, after reranking.
+    std::vector<std::pair<double, std::string_view>> GetCandidates(
+        const TKeyboardLayout& layout,
+        const TSwipeEvent& swipeEvent,
+        const TSearchParams& params,
+        TResultCache* cache = nullptr,
+        const TDictOverlay* overlay = nullptr) const;
+
+    std::vector<std::vector<std::pair<double, std::string_view>>> GetCandidates(
+        const TKeyboardLayout& layout,
+        const std::vector<TSwipeEvent>& swipeEvents,
+        const TSearchParams& params,
+        TResultCache* cache = nullptr,
+        const TDictOverlay* overlay = nullptr) const;
+
+    size_t GetWordsCount() const;
+private:
+    void ParallelFor(const std::function<void(size_t)>& task) const;
+    TSearchParams GetDictParams(const TSearchParams& params) const;
+    void Rerank(
+        const size_t dictIdx,
+        const std::vector<TCoord>& points,
+        const TShortEmbedding& shortEmbedding,
+        const TSearchParams& params,
+        std::vector<std::pair<double, std::string_view>>& candidates) const;
+    std::vector<std::pair<double, std::string_view>> GetOverlayCandidates(
+        const TKeyboardLayout& layout,
+        const std::vector<TCoord>& points,
+        const TShortEmbedding& shortEmbedding,
+        const TDictOverlay& overlay,
+        const TSearchParams& params) const;
+    void MergeCandidates(
+        std::vector<std::pair<double, std::string_view>>& candidates,
+        std::vector<std::pair<double, std::string_view>>& dictCandidates,
+        const size_t dictIdx,
+        const size_t topSize) const;
+};
@@ -0,0 +1,224 @@
+#include "dict_updater.h"
+
+#include <iostream>
+#include <mutex>
+
+namespace {
+    // re-balanced mapped clusters never overwrite the file built for the
+    // dict, which later runs may still reuse
+    std::string GetRebalancedStoragePath(const std::string& path) {
+        const std::string suffix = ".rebalanced";
+        if (path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            return path;
+        }
+        return path + suffix;
+    }
+
+    // the storage words were added to, without their overlay
+    const TClusterStorage* GetBaseStorage(const TClusterStorage* storage) {
+        if (const TOverlayClusterStorage* overlay = dynamic_cast<const TOverlayClusterStorage*>(storage)) {
+            return &overlay->GetBase();
+        }
+        return storage;
+    }
+}
+
+void TDictUpdater::TParams::AddHandlers(TArgsParser& argsParser) {
+    argsParser.AddHandler("max-center-drift", &MaxCenterDrift, "re-balance clusters after updates move a center this far, 0 to ignore").Optional();
+    argsParser.AddHandler("max-size-skew", &MaxSizeSkew, "re-balance clusters after updates make the largest one this many times the mean, 0 to ignore").Optional();
+    argsParser.AddHandler("rebalance-max-churn", &MaxChurn, "stop re-balance iterations once a pass moves at most this share of words").Optional();
+}
+
+TDictUpdater::TDictUpdater(TKeyboardLayout& layout, TDictSet& dicts, const TParams& params, TResultCache* cache /*= nullptr*/)
+    : Layout(layout)
+    , Dicts(dicts)
+    , Cache(cache)
+    , Params(params)
+    , Rebalancing(false)
+    , RebalancesCount(0)
+{
+}
+
+TDictUpdater::~TDictUpdater() {
+    WaitRebalance();
+}
+
+bool TDictUpdater::AddWord(const std::string_view word) {
+    std::unique_lock<std::shared_mutex> guard(Mutex);
+    TDict& dict = *Dicts.Dicts.front();
+    if (!Layout.AddWord(dict, word)) {
+        return false;
+    }
+    if (Cache) {
+        Cache->Clear();
+    }
+    MaybeStartRebalance(dict);
+    return true;
+}
+
+bool TDictUpdater::RemoveWord(const std::string_view word) {
+    std::unique_lock<std::shared_mutex> guard(Mutex);
+    bool removed = false;
+    for (const std::unique_ptr<TDict>& dict : Dicts.Dicts) {
+        if (Layout.RemoveWord(*dict, word)) {
+            removed = true;
+            MaybeStartRebalance(*dict);
+        }
+    }
+    if (removed && Cache) {
+        Cache->Clear();
+    }
+    return removed;
+}
+
+std::vector<std::pair<double, std::string_view>> TDictUpdater::GetCandidates(
+    const TSwipeEvent& swipeEvent,
+    const TSearchParams& params,
+    const TDictOverlay* overlay /*= nullptr*/) const
+{
+    std::shared_lock<std::shared_mutex> guard(Mutex);
+    return Dicts.GetCandidates(Layout, swipeEvent, params, Cache, overlay);
+}
+
+void TDictUpdater::WaitRebalance() {
+    if (RebalanceThread.joinable()) {
+        RebalanceThread.join();
+    }
+}
+
+size_t TDictUpdater::GetRebalancesCount() const {
+    return RebalancesCount;
+}
+
+// one re-balance at a time, a dictionary still off balance afterwards
+// starts its own on its next update
+void TDictUpdater::MaybeStartRebalance(TDict& dict) {
+    if (Rebalancing) {
+        return;
+    }
+
+    const bool drifted = Params.MaxCenterDrift > 0. && dict.GetMaxCenterDrift() > Params.MaxCenterDrift;
+    const bool skewed = Params.MaxSizeSkew > 0. && dict.GetClusterSizeSkew() > Params.MaxSizeSkew;
+    if (!drifted && !skewed) {
+        return;
+    }
+
+    if (RebalanceThread.joinable()) {
+        RebalanceThread.join();
+    }
+    Rebalancing = true;
+    RebalanceThread = std::thread([this, &dict]() {
+        Rebalance(dict);
+    });
+}
+
+void TDictUpdater::Rebalance(TDict& dict) {
+    // the re-clustering runs on a snapshot, queries and updates go on meanwhile
+    TDict rebalanced;
+    size_t snapshotSize = 0;
+    std::vector<unsigned int> liveClusters;
+    std::string mappedPath;
+    bool packed = false;
+    {
+        std::shared_lock<std::shared_mutex> guard(Mutex);
+        rebalanced.Kernels = dict.Kernels;
+        rebalanced.WordKeys = dict.WordKeys;
+        rebalanced.WordKeyOffsets = dict.WordKeyOffsets;
+        rebalanced.ClusterCenters = dict.ClusterCenters;
+        rebalanced.Removed = dict.Removed;
+        rebalanced.Representatives = dict.Representatives;
+        rebalanced.NextSibling = dict.NextSibling;
+        liveClusters = dict.WordClusters;
+        snapshotSize = dict.Words.GetSize();
+
+        const TClusterStorage* storage = GetBaseStorage(dict.Storage.get());
+        if (const TMappedClusterStorage* mapped = dynamic_cast<const TMappedClusterStorage*>(storage)) {
+            mappedPath = GetRebalancedStoragePath(mapped->GetPath());
+        }
+        packed = dynamic_cast<const TPackedClusterStorage*>(storage) != nullptr;
+    }
+
+    // groups removed by then are left out of the new clusters for good
+    const std::vector<TWordIndex> representatives = rebalanced.GetLiveRepresentatives();
+    std::vector<std::vector<TCoord>> shortWordEmbeddings;
+    shortWordEmbeddings.reserve(representatives.size());
+    // words moved are counted against the clusters they are served from
+    std::vector<unsigned int> modelClusters;
+    modelClusters.reserve(representatives.size());
+    for (const TWordIndex wordIdx : representatives) {
+        shortWordEmbeddings.push_back(rebalanced.ShortenEmbedding(Layout.MakePoints(rebalanced.GetWordKeys(wordIdx))));
+        modelClusters.push_back(liveClusters[wordIdx]);
+    }
+
+    const size_t clustersCount = rebalanced.ClusterCenters.size();
+    const size_t moved = rebalanced.RefineClusters(Params.RebalanceIterations, Params.MaxChurn, shortWordEmbeddings, 0, modelClusters);
+
+    rebalanced.RemapClusterWords(representatives);
+    shortWordEmbeddings = TKeyboardLayout::SpreadByWords(shortWordEmbeddings, representatives, snapshotSize);
+    rebalanced.UpdateClusterStats(shortWordEmbeddings);
+
+    // storage of the same kind as the active one: mapped storage goes to a
+    // file of its own, packed storage is placed again
+    if (!Layout.BuildClusterStorage(rebalanced, mappedPath) ||
+        (packed && !PlaceModel(Params.Placement, rebalanced)))
+    {
+        std::cerr << "cannot build re-balanced cluster storage, clusters are kept" << std::endl;
+        Rebalancing = false;
+        return;
+    }
+    rebalanced.UpdateClusterEmbeddings();
+    if (!Layout.BuildClusterIndex(rebalanced)) {
+        Rebalancing = false;
+        return;
+    }
+
+    {
+        std::unique_lock<std::shared_mutex> guard(Mutex);
+
+        // groups emptied while re-balancing leave the new statistics
+        for (const TWordIndex wordIdx : representatives) {
+            if (dict.IsGroupRemoved(wordIdx)) {
+                rebalanced.RemoveFromClusterStats(wordIdx, shortWordEmbeddings[wordIdx]);
+            }
+        }
+
+        // words added meanwhile join their nearest new cluster
+        rebalanced.WordKeys = dict.WordKeys;
+        rebalanced.WordKeyOffsets = dict.WordKeyOffsets;
+        rebalanced.WordClusters.resize(dict.Words.GetSize(), 0);
+        for (size_t wordIdx = snapshotSize; wordIdx < dict.Words.GetSize(); ++wordIdx) {
+            if (!dict.IsRepresentative(wordIdx)) {
+                continue;
+            }
+            const TKeyPath path = rebalanced.GetWordKeys(wordIdx);
+            const std::vector<TCoord> embedding = Layout.MakePoints(path);
+            const std::vector<TCoord> shortEmbedding = rebalanced.ShortenEmbedding(embedding);
+
+            const size_t clusterId = rebalanced.GetClusterForShort(shortEmbedding).first;
+            rebalanced.AddToClusterStorage(wordIdx, clusterId, TKeyboardLayout::GetKeyMask(path), embedding.data());
+            if (!dict.IsGroupRemoved(wordIdx)) {
+                rebalanced.AddToClusterStats(wordIdx, clusterId, shortEmbedding);
+            }
+        }
+
+        // swapped, so that the old clusters are freed once the lock is
+        // released; the index keeps pointing into the swapped buffers
+        dict.ClusterCenters.swap(rebalanced.ClusterCenters);
+        dict.ClusterWords.swap(rebalanced.ClusterWords);
+        dict.Storage.swap(rebalanced.Storage);
+        dict.NodeStorages.swap(rebalanced.NodeStorages);
+        dict.WordClusters.swap(rebalanced.WordClusters);
+        dict.ClusterSums.swap(rebalanced.ClusterSums);
+        dict.ClusterSizes.swap(rebalanced.ClusterSizes);
+        dict.ClusterEmbeddings.swap(rebalanced.ClusterEmbeddings);
+        dict.ClusterIndex.swap(rebalanced.ClusterIndex);
+
+        if (Cache) {
+            Cache->Clear();
+        }
+        ++RebalancesCount;
+        Rebalancing = false;
+    }
+
+    std::cerr << "rebalanced " << clustersCount << " clusters, " << moved << " words moved" << std::endl;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "dict.h"
+#include "dict_set.h"
+#include "model.h"
+#include "result_cache.h"
+#include "swipe.h"
+
+#include <atomic>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Thread-safe runtime additions and removals of words on top of a built
+// set of dictionaries: words are added to the first dictionary and removed
+// from all of them, queries meanwhile go through GetCandidates. Updates
+// only touch the nearest cluster; once a center has drifted too far from
+// its members or clusters got too uneven, a warm-started re-clustering of
+// that dictionary runs in the background. Its storage, placement and index
+// are built aside as well and swapped in under a short exclusive lock.
+class TDictUpdater {
+public:
+    struct TParams {
+        // start re-balancing when some center is farther than this from the
+        // mean of its live words, 0 to ignore drift
+        double MaxCenterDrift = 0.;
+        // ... or when the largest cluster is this many times the mean size
+        double MaxSizeSkew = 0.;
+        size_t RebalanceIterations = 3;
+        // ... or fewer, once a pass moves at most this share of the words
+        double MaxChurn = 0.;
+        // placement the model got from PlaceModel, re-applied to re-balanced
+        // clusters while the storage is packed
+        TPlacementParams Placement;
+
+        void AddHandlers(TArgsParser& argsParser);
+    };
+private:
+    TKeyboardLayout& Layout;
+    TDictSet& Dicts;
+    TResultCache* Cache;
+    const TParams Params;
+
+    mutable std::shared_mutex Mutex;
+    std::thread RebalanceThread;
+    std::atomic<bool> Rebalancing;
+    std::atomic<size_t> RebalancesCount;
+public:
+    TDictUpdater(TKeyboardLayout& layout, TDictSet& dicts, const TParams& params, TResultCache* cache = nullptr);
+    ~TDictUpdater();
+
+    bool AddWord(const std::string_view word);
+    // false if no dictionary had the word
+    bool RemoveWord(const std::string_view word);
+
+    std::vector<std::pair<double, std::string_view>> GetCandidates(
+        const TSwipeEvent& swipeEvent,
+        const TSearchParams& params,
+        const TDictOverlay* overlay = nullptr) const;
+
+    void WaitRebalance();
+    size_t GetRebalancesCount() const;
+private:
+    void MaybeStartRebalance(TDict& dict);
+    void Rebalance(TDict& dict);
+};
@@ -0,0 +1,59 @@
+#include "embedding.h"
+
+#include <sstream>
+#include <utility>
+
+using TSupportedLengths = std::index_sequence<16, 20, 32, 48, 50, 64>;
+
+template <size_t Length, size_t ShortLength>
+static const TEmbeddingKernels* GetEmbeddingKernels() {
+    static const TEmbeddingKernels kernels = [](){
+        TEmbeddingKernels result;
+        result.Length = Length;
+        result.ShortLength = ShortLength;
+        result.SumSquaredDistances = &::SumSquaredDistances<Length>;
+        result.ShortSumSquaredDistances = &::SumSquaredDistances<ShortLength>;
+        result.BatchShortDistances = &::BatchDistances<ShortLength>;
+        result.Shorten = &::ShortenEmbedding<Length, ShortLength>;
+        return result;
+    }();
+    return &kernels;
+}
+
+template <size_t Length, size_t... ShortLengths>
+static const TEmbeddingKernels* FindForLength(const size_t shortLength, std::index_sequence<ShortLengths...>) {
+    const TEmbeddingKernels* result = nullptr;
+    ((shortLength == ShortLengths ? (result = GetEmbeddingKernels<Length, ShortLengths>(), true) : false) || ...);
+    return result;
+}
+
+template <size_t... Lengths>
+static const TEmbeddingKernels* Find(const size_t length, const size_t shortLength, std::index_sequence<Lengths...>) {
+    const TEmbeddingKernels* result = nullptr;
+    ((length == Lengths ? (result = FindForLength<Lengths>(shortLength, TSupportedLengths()), true) : false) || ...);
+    return result;
+}
+
+template <size_t... Lengths>
+static std::string ListLengths(std::index_sequence<Lengths...>) {
+    std::stringstream ss;
+    ((ss << Lengths << " "), ...);
+    std::string result = ss.str();
+    result.pop_back();
+    return result;
+}
+
+const TEmbeddingKernels* FindEmbeddingKernels(const size_t length, const size_t shortLength) {
+    if (shortLength > length) {
+        return nullptr;
+    }
+    return Find(length, shortLength, TSupportedLengths());
+}
+
+const TEmbeddingKernels* DefaultEmbeddingKernels() {
+    return GetEmbeddingKernels<DefaultEmbeddingLength, DefaultShortEmbeddingLength>();
+}
+
+std::string SupportedEmbeddingLengths() {
+    return ListLengths(TSupportedLengths());
+}
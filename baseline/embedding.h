@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <cmath>
+
+enum {
+    DefaultEmbeddingLength = 50,
+    DefaultShortEmbeddingLength = 20
+};
+
+struct TCoord {
+    double X;
+    double Y;
+
+    TCoord(const double x = 0., const double y = 0.)
+        : X(x)
+        , Y(y)
+    {
+    }
+};
+
+template <size_t Length>
+static inline double SumSquaredDistances(const TCoord* lhs, const TCoord* rhs) {
+    double sumSquaredDistances = 0.;
+#pragma GCC unroll 64
+    for (size_t i = 0; i < Length; ++i) {
+        const double xDiff = lhs[i].X - rhs[i].X;
+        const double yDiff = lhs[i].Y - rhs[i].Y;
+
+        sumSquaredDistances += xDiff * xDiff + yDiff * yDiff;
+    }
+    return sumSquaredDistances;
+}
+
+// root mean squared distances from one point to each of count others, the
+// same values as one by one, written contiguously
+template <size_t Length>
+static inline void BatchDistances(const TCoord* point, const TCoord* const* others, const size_t count, double* distances) {
+    for (size_t i = 0; i < count; ++i) {
+        distances[i] = sqrt(std::max(0., SumSquaredDistances<Length>(others[i], point)) / Length);
+    }
+}
+
+template <size_t Length, size_t ShortLength>
+static inline void ShortenEmbedding(const TCoord* embedding, TCoord* shortEmbedding) {
+#pragma GCC unroll 64
+    for (size_t i = 0; i < ShortLength; ++i) {
+        const size_t start = i * Length / ShortLength;
+        const size_t end = (i + 1) * Length / ShortLength;
+
+        double x = 0.;
+        double y = 0.;
+        for (size_t j = start; j < end; ++j) {
+            x += embedding[j].X;
+            y += embedding[j].Y;
+        }
+
+        const double count = end > start ? end - start : 1;
+        shortEmbedding[i].X = x / count;
+        shortEmbedding[i].Y = y / count;
+    }
+}
+
+// Fixed-length kernels for one (embedding, short embedding) lengths pair.
+// Every pair of lengths from SupportedEmbeddingLengths() is instantiated at
+// compile time, so each kernel has a known trip count; the pair itself is
+// chosen at runtime with FindEmbeddingKernels.
+struct TEmbeddingKernels {
+    size_t Length = 0;
+    size_t ShortLength = 0;
+
+    double (*SumSquaredDistances)(const TCoord* lhs, const TCoord* rhs) = nullptr;
+    double (*ShortSumSquaredDistances)(const TCoord* lhs, const TCoord* rhs) = nullptr;
+    void (*BatchShortDistances)(const TCoord* point, const TCoord* const* others, const size_t count, double* distances) = nullptr;
+    void (*Shorten)(const TCoord* embedding, TCoord* shortEmbedding) = nullptr;
+
+    double Score(const TCoord* lhs, const TCoord* rhs) const {
+        return -SumSquaredDistances(lhs, rhs);
+    }
+
+    double Score(const std::vector<TCoord>& lhs, const std::vector<TCoord>& rhs) const {
+        return Score(lhs.data(), rhs.data());
+    }
+
+    double ShortDistance(const TCoord* lhs, const TCoord* rhs) const {
+        return sqrt(std::max(0., ShortSumSquaredDistances(lhs, rhs)) / ShortLength);
+    }
+
+    double ShortDistance(const std::vector<TCoord>& lhs, const std::vector<TCoord>& rhs) const {
+        return ShortDistance(lhs.data(), rhs.data());
+    }
+
+    std::vector<TCoord> ShortenEmbedding(const std::vector<TCoord>& embedding) const {
+        std::vector<TCoord> shortEmbedding(ShortLength);
+        Shorten(embedding.data(), shortEmbedding.data());
+        return shortEmbedding;
+    }
+};
+
+const TEmbeddingKernels* FindEmbeddingKernels(const size_t length, const size_t shortLength);
+const TEmbeddingKernels* DefaultEmbeddingKernels();
+
+std::string SupportedEmbeddingLengths();
@@ -0,0 +1,235 @@
+#include "features.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <cmath>
+
+namespace {
+    const char* FeatureNames[FeaturesCount] = {
+        "score",
+        "symmetric-distance",
+        "keys-distance",
+        "swipe-turns",
+        "word-turns",
+        "start-distance",
+        "end-distance",
+        "path-length-ratio",
+        "cluster-rank",
+    };
+
+    double GetPathLength(const std::vector<TCoord>& points) {
+        double length = 0.;
+        for (size_t i = 0; i + 1 < points.size(); ++i) {
+            length += std::hypot(points[i + 1].X - points[i].X, points[i + 1].Y - points[i].Y);
+        }
+        return length;
+    }
+
+    bool HasFeature(const uint64_t featuresMask, const size_t feature) {
+        return (featuresMask >> feature) & 1;
+    }
+}
+
+const char* GetFeatureName(const size_t feature) {
+    return FeatureNames[feature];
+}
+
+TFeatureExtractor::TFeatureExtractor(const TKeyboardLayout& layout, const TDict& dict)
+    : Layout(layout)
+    , Dict(dict)
+    , KeyWidth(layout.KeyWidth())
+{
+    const TClusterStorage& storage = dict.GetStorage();
+    Locations.assign(dict.Words.GetSize(), std::make_pair(NoCluster, 0));
+    for (size_t clusterId = 0; clusterId < storage.GetClustersCount(); ++clusterId) {
+        const TClusterBlock block = storage.GetBlock(clusterId);
+        for (size_t i = 0; i < block.Size; ++i) {
+            if (block.Words[i] < Locations.size()) {
+                Locations[block.Words[i]] = std::make_pair(clusterId, i);
+            }
+        }
+    }
+}
+
+void TFeatureExtractor::Extract(
+    const std::vector<TCoord>& points,
+    const TShortEmbedding& shortEmbedding,
+    std::vector<std::pair<double, std::string_view>>& candidates,
+    const size_t clustersLimit,
+    const uint64_t featuresMask,
+    std::vector<float>& features) const
+{
+    std::vector<std::vector<TKeyId>> keyPaths;
+    size_t kept = 0;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        std::vector<TKeyId> keys = Layout.EncodeWord(candidates[i].second);
+        if (!keys.empty()) {
+            candidates[kept++] = candidates[i];
+            keyPaths.push_back(std::move(keys));
+        }
+    }
+    candidates.resize(kept);
+
+    const size_t count = candidates.size();
+    features.assign(FeaturesCount * count, 0.f);
+    auto column = [&](const EFeature feature) {
+        return features.data() + feature * count;
+    };
+
+    const size_t length = Layout.Kernels->Length;
+    const double squaredKeyWidth = KeyWidth * KeyWidth;
+    const TClusterStorage& storage = Dict.GetStorage();
+
+    // clusters the decoder would probe, nearest first
+    std::vector<size_t> clusterRanks;
+    if (HasFeature(featuresMask, FeatureClusterRank) && Dict.ClusterIndex) {
+        std::vector<std::pair<double, size_t>> probes;
+        for (const TShortEmbedding* foundCluster : Dict.ClusterIndex->FindClusters(shortEmbedding, clustersLimit)) {
+            probes.push_back(std::make_pair(Dict.Kernels->ShortDistance(shortEmbedding.Coords, foundCluster->Coords), foundCluster->Idx));
+        }
+        std::sort(probes.begin(), probes.end());
+
+        clusterRanks.assign(Dict.ClusterEmbeddings.size(), clustersLimit);
+        for (size_t rank = 0; rank < probes.size(); ++rank) {
+            clusterRanks[probes[rank].second] = rank;
+        }
+    }
+
+    const double swipeTurns = Layout.GetInterestingPoints(points).size() - 2;
+    const double swipeLength = GetPathLength(points);
+
+    std::vector<TCoord> wordPoints;
+    for (size_t i = 0; i < count; ++i) {
+        const std::vector<TKeyId>& keys = keyPaths[i];
+        TKeyPath path;
+        path.Keys = keys.data();
+        path.Size = keys.size();
+
+        column(FeatureScore)[i] = candidates[i].first;
+
+        const TDict::TWordIndex representative = Dict.FindGroup(path);
+        size_t clusterId = NoCluster;
+        const TCoord* embedding = nullptr;
+        if (representative != TDict::NoWord && representative < Locations.size() && Locations[representative].first != NoCluster) {
+            const TClusterBlock block = storage.GetBlock(Locations[representative].first);
+            const size_t position = Locations[representative].second;
+            if (position < block.Size && block.Words[position] == representative) {
+                clusterId = Locations[representative].first;
+                embedding = block.Embeddings + position * length;
+            }
+        }
+        if (clusterId == NoCluster && representative != TDict::NoWord && representative < Dict.WordClusters.size()) {
+            clusterId = Dict.WordClusters[representative];
+        }
+
+        if (HasFeature(featuresMask, FeatureSymmetricDistance)) {
+            if (embedding) {
+                wordPoints.assign(embedding, embedding + length);
+            } else {
+                wordPoints = Layout.MakePoints(path);
+            }
+            column(FeatureSymmetricDistance)[i] = Layout.SymmetricDistance(wordPoints, points) / length / squaredKeyWidth;
+        }
+        if (HasFeature(featuresMask, FeatureKeysDistance)) {
+            column(FeatureKeysDistance)[i] = Layout.AsymmetricDistance(keys, points) / keys.size() / squaredKeyWidth;
+        }
+        column(FeatureSwipeTurns)[i] = swipeTurns;
+        if (HasFeature(featuresMask, FeatureWordTurns)) {
+            column(FeatureWordTurns)[i] = Layout.GetInterestingKeys(path).size() - 2;
+        }
+        column(FeatureStartDistance)[i] = std::sqrt(Layout.Distance(points.front(), Layout.KeyCenters[keys.front()])) / KeyWidth;
+        column(FeatureEndDistance)[i] = std::sqrt(Layout.Distance(points.back(), Layout.KeyCenters[keys.back()])) / KeyWidth;
+        if (HasFeature(featuresMask, FeaturePathLengthRatio)) {
+            // a key width on both sides keeps one-key words finite
+            double wordLength = 0.;
+            for (size_t j = 0; j + 1 < keys.size(); ++j) {
+                wordLength += std::sqrt(Layout.KeyDistance(keys[j], keys[j + 1]));
+            }
+            column(FeaturePathLengthRatio)[i] = (swipeLength + KeyWidth) / (wordLength + KeyWidth);
+        }
+        if (!clusterRanks.empty()) {
+            column(FeatureClusterRank)[i] = clusterId < clusterRanks.size() ? clusterRanks[clusterId] : clustersLimit;
+        }
+    }
+}
+
+bool TLinearReranker::Load(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "cannot open reranker " << path << std::endl;
+        return false;
+    }
+
+    Bias = 0.;
+    Weights.assign(FeaturesCount, 0.);
+    FeaturesMask = 0;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::stringstream ss(line);
+        std::string name;
+        double weight = 0.;
+        if (!(ss >> name >> weight)) {
+            std::cerr << "bad reranker line: " << line << std::endl;
+            return false;
+        }
+        if (name == "bias") {
+            Bias = weight;
+            continue;
+        }
+
+        size_t feature = 0;
+        while (feature < FeaturesCount && name != FeatureNames[feature]) {
+            ++feature;
+        }
+        if (feature == FeaturesCount) {
+            std::cerr << "unknown reranker feature: " << name << std::endl;
+            return false;
+        }
+        Weights[feature] = weight;
+        FeaturesMask |= uint64_t(1) << feature;
+    }
+    return true;
+}
+
+void TLinearReranker::Rerank(
+    const TFeatureExtractor& extractor,
+    const std::vector<TCoord>& points,
+    const TShortEmbedding& shortEmbedding,
+    const size_t clustersLimit,
+    const size_t topSize,
+    std::vector<std::pair<double, std::string_view>>& candidates) const
+{
+    std::vector<float> features;
+    extractor.Extract(points, shortEmbedding, candidates, clustersLimit, FeaturesMask, features);
+    const size_t count = candidates.size();
+
+    // feature-major columns keep the inner loop a plain vectorizable axpy
+    std::vector<double> scores(count, Bias);
+    for (size_t feature = 0; feature < FeaturesCount; ++feature) {
+        if (!HasFeature(FeaturesMask, feature)) {
+            continue;
+        }
+        const float* values = features.data() + feature * count;
+        const double weight = Weights[feature];
+        for (size_t i = 0; i < count; ++i) {
+            scores[i] += weight * values[i];
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        candidates[i].first = scores[i];
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first > rhs.first;
+    });
+    if (candidates.size() > topSize) {
+        candidates.resize(topSize);
+    }
+}
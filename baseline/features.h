@@ -0,0 +1,86 @@
+#pragma once
+
+#include "dict.h"
+#include "swipe.h"
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+// Geometric features of a candidate word for a swipe. Distances are in key
+// widths, squared distances in squared key widths.
+enum EFeature {
+    // the L2 score candidates are ranked by
+    FeatureScore,
+    // mean squared distance between word and swipe embeddings, see
+    // TKeyboardLayout::SymmetricDistance
+    FeatureSymmetricDistance,
+    // how far the word's key centers are from the swipe, in order
+    FeatureKeysDistance,
+    // number of sharp turns, see TKeyboardLayout::GetInterestingPoints
+    FeatureSwipeTurns,
+    FeatureWordTurns,
+    FeatureStartDistance,
+    FeatureEndDistance,
+    // swipe length to the length of the path through the word's keys
+    FeaturePathLengthRatio,
+    // position of the word's cluster among the probed ones, clusters limit if not probed
+    FeatureClusterRank,
+    FeaturesCount
+};
+
+const char* GetFeatureName(const size_t feature);
+
+// Computes features of candidates decoded in one dict. Word embeddings are
+// read from the dict's cluster storage; words not found where they were at
+// construction (added or re-clustered since) get theirs computed.
+class TFeatureExtractor {
+private:
+    static constexpr uint32_t NoCluster = static_cast<uint32_t>(-1);
+
+    const TKeyboardLayout& Layout;
+    const TDict& Dict;
+    const double KeyWidth;
+
+    // cluster and position in its storage block of every clustered word
+    std::vector<std::pair<uint32_t, uint32_t>> Locations;
+public:
+    TFeatureExtractor(const TKeyboardLayout& layout, const TDict& dict);
+
+    // Fills features of the candidates feature-major, value of feature f
+    // for candidate i goes to features[f * candidates.size() + i]. Costly
+    // features are computed only with their bit set in featuresMask.
+    // Candidates with no keys on the layout have no geometry to describe
+    // and are dropped first.
+    void Extract(
+        const std::vector<TCoord>& points,
+        const TShortEmbedding& shortEmbedding,
+        std::vector<std::pair<double, std::string_view>>& candidates,
+        const size_t clustersLimit,
+        const uint64_t featuresMask,
+        std::vector<float>& features) const;
+};
+
+// Linear model over candidate features, loaded from a text file with one
+// "feature-name weight" line per used feature and an optional "bias" line.
+class TLinearReranker {
+private:
+    double Bias = 0.;
+    std::vector<double> Weights;
+    uint64_t FeaturesMask = 0;
+public:
+    bool Load(const std::string& path);
+
+    // Re-scores candidates with the model and keeps topSize best of them,
+    // see TFeatureExtractor::Extract for candidates that are dropped.
+    void Rerank(
+        const TFeatureExtractor& extractor,
+        const std::vector<TCoord>& points,
+        const TShortEmbedding& shortEmbedding,
+        const size_t clustersLimit,
+        const size_t topSize,
+        std::vector<std::pair<double, std::string_view>>& candidates) const;
+};
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+// Hierarchical navigable small world graph (Malkov, Yashunin) over items
+// owned by the caller. Every item lives on layers 0..level with level drawn
+// from a geometric distribution; a search descends greedily through the
+// sparse upper layers and runs a best-first search with Ef candidates on
+// layer 0.
+template <class T, class TMetric>
+class THnswIndex {
+public:
+    struct TParams {
+        // max links per item on upper layers, twice that on layer 0
+        size_t M = 16;
+        size_t EfConstruction = 200;
+        size_t EfSearch = 64;
+        size_t ThreadsCount = 1;
+    };
+private:
+    using TItemIndex = uint32_t;
+    using TCandidate = std::pair<double, TItemIndex>;
+
+    struct TNode {
+        // Layers[l] holds links of the item on layer l
+        std::vector<std::vector<TItemIndex>> Layers;
+    };
+
+    const TMetric Metric;
+    const TParams Params;
+
+    std::vector<T*> Items;
+    std::vector<TNode> Nodes;
+
+    // construction only: links of a node are guarded by its mutex, entry
+    // point and top level by EntryMutex
+    std::unique_ptr<std::mutex[]> NodeMutexes;
+    std::mutex EntryMutex;
+
+    TItemIndex EntryPoint = 0;
+    int MaxLevel = -1;
+
+    static constexpr char Magic[8] = {'S', 'W', 'H', 'N', 'S', 'W', '0', '1'};
+public:
+    template <typename TInputIterator>
+    THnswIndex(TInputIterator begin, TInputIterator end, const TMetric& metric = TMetric(), const TParams& params = TParams())
+        : Metric(metric)
+        , Params(params)
+        , Items(std::distance(begin, end))
+    {
+        size_t i = 0;
+        for (TInputIterator it = begin; it < end; ++it, ++i) {
+            Items[i] = &(*it);
+        }
+    }
+
+    void Build() {
+        Nodes.assign(Items.size(), TNode());
+        EntryPoint = 0;
+        MaxLevel = -1;
+        if (Items.empty()) {
+            return;
+        }
+
+        std::mt19937_64 random;
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        const double levelMultiplier = 1. / std::log(std::max<size_t>(Params.M, 2));
+        for (TNode& node : Nodes) {
+            const int level = static_cast<int>(-std::log(1. - uniform(random)) * levelMultiplier);
+            node.Layers.resize(level + 1);
+        }
+
+        NodeMutexes.reset(new std::mutex[Items.size()]);
+
+        EntryPoint = 0;
+        MaxLevel = static_cast<int>(Nodes[0].Layers.size()) - 1;
+
+        std::atomic<size_t> next(1);
+        auto insertAll = [&]() {
+            for (size_t idx = next++; idx < Items.size(); idx = next++) {
+                Insert(idx);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::max<size_t>(Params.ThreadsCount, 1); ++i) {
+            threads.emplace_back(insertAll);
+        }
+        insertAll();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        NodeMutexes.reset();
+    }
+
+    // at most limit items nearest to the query, nearest first
+    std::vector<T*> FindNearestItems(const T& query, const size_t limit) const {
+        std::vector<T*> result;
+        if (Nodes.empty() || !limit) {
+            return result;
+        }
+
+        TCandidate current(Metric.Distance(query, *Items[EntryPoint]), EntryPoint);
+        for (int layer = MaxLevel; layer > 0; --layer) {
+            current = SearchGreedy(query, current, layer, false);
+        }
+
+        const std::vector<TCandidate> found = SearchLayer(query, current, std::max(Params.EfSearch, limit), 0, false);
+        for (size_t i = 0; i < found.size() && i < limit; ++i) {
+            result.push_back(Items[found[i].second]);
+        }
+        return result;
+    }
+
+    // links only, items are bound again by the constructor before Load
+    bool Save(std::ostream& out) const {
+        const uint64_t header[4] = {Items.size(), Params.M, EntryPoint, static_cast<uint64_t>(MaxLevel + 1)};
+        out.write(Magic, sizeof(Magic));
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        for (const TNode& node : Nodes) {
+            const uint64_t layersCount = node.Layers.size();
+            out.write(reinterpret_cast<const char*>(&layersCount), sizeof(layersCount));
+            for (const std::vector<TItemIndex>& links : node.Layers) {
+                const uint64_t linksCount = links.size();
+                out.write(reinterpret_cast<const char*>(&linksCount), sizeof(linksCount));
+                out.write(reinterpret_cast<const char*>(links.data()), links.size() * sizeof(TItemIndex));
+            }
+        }
+        return !out.fail();
+    }
+
+    bool Load(std::istream& in) {
+        char magic[sizeof(Magic)];
+        uint64_t header[4];
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!in || memcmp(magic, Magic, sizeof(Magic)) != 0 || header[0] != Items.size() || header[2] >= std::max<size_t>(Items.size(), 1)) {
+            return false;
+        }
+
+        std::vector<TNode> nodes(Items.size());
+        for (TNode& node : nodes) {
+            uint64_t layersCount = 0;
+            in.read(reinterpret_cast<char*>(&layersCount), sizeof(layersCount));
+            if (!in || !layersCount || layersCount > header[3]) {
+                return false;
+            }
+            node.Layers.resize(layersCount);
+            for (std::vector<TItemIndex>& links : node.Layers) {
+                uint64_t linksCount = 0;
+                in.read(reinterpret_cast<char*>(&linksCount), sizeof(linksCount));
+                if (!in || linksCount > Items.size()) {
+                    return false;
+                }
+                links.resize(linksCount);
+                in.read(reinterpret_cast<char*>(links.data()), links.size() * sizeof(TItemIndex));
+                for (const TItemIndex link : links) {
+                    if (link >= Items.size()) {
+                        return false;
+                    }
+                }
+            }
+        }
+        if (!in || (!nodes.empty() && nodes[header[2]].Layers.size() != header[3])) {
+            return false;
+        }
+
+        Nodes.swap(nodes);
+        EntryPoint = header[2];
+        MaxLevel = static_cast<int>(header[3]) - 1;
+        return true;
+    }
+private:
+    size_t GetMaxLinks(const int layer) const {
+        return layer ? Params.M : 2 * Params.M;
+    }
+
+    template <typename TCallback>
+    void ForEachLink(const TItemIndex idx, const int layer, const bool locked, TCallback&& callback) const {
+        if (!locked) {
+            for (const TItemIndex link : Nodes[idx].Layers[layer]) {
+                callback(link);
+            }
+            return;
+        }
+
+        std::vector<TItemIndex> links;
+        {
+            std::lock_guard<std::mutex> guard(NodeMutexes[idx]);
+            links = Nodes[idx].Layers[layer];
+        }
+        for (const TItemIndex link : links) {
+            callback(link);
+        }
+    }
+
+    TCandidate SearchGreedy(const T& query, TCandidate current, const int layer, const bool locked) const {
+        for (bool changed = true; changed;) {
+            changed = false;
+            ForEachLink(current.second, layer, locked, [&](const TItemIndex link) {
+                const double distance = Metric.Distance(query, *Items[link]);
+                if (distance < current.first) {
+                    current = TCandidate(distance, link);
+                    changed = true;
+                }
+            });
+        }
+        return current;
+    }
+
+    // best-first search of one layer, ef nearest found items ordered by distance
+    std::vector<TCandidate> SearchLayer(const T& query, const TCandidate& entry, const size_t ef, const int layer, const bool locked) const {
+        static thread_local std::vector<uint32_t> visitMarks;
+        static thread_local uint32_t visitEpoch = 0;
+        if (visitMarks.size() < Items.size()) {
+            visitMarks.resize(Items.size(), 0);
+        }
+        if (++visitEpoch == 0) {
+            std::fill(visitMarks.begin(), visitMarks.end(), 0);
+            visitEpoch = 1;
+        }
+
+        std::priority_queue<TCandidate, std::vector<TCandidate>, std::greater<TCandidate>> candidates;
+        std::priority_queue<TCandidate> nearest;
+
+        visitMarks[entry.second] = visitEpoch;
+        candidates.push(entry);
+        nearest.push(entry);
+
+        while (!candidates.empty()) {
+            const TCandidate candidate = candidates.top();
+            if (candidate.first > nearest.top().first && nearest.size() >= ef) {
+                break;
+            }
+            candidates.pop();
+
+            ForEachLink(candidate.second, layer, locked, [&](const TItemIndex link) {
+                if (visitMarks[link] == visitEpoch) {
+                    return;
+                }
+                visitMarks[link] = visitEpoch;
+
+                const double distance = Metric.Distance(query, *Items[link]);
+                if (nearest.size() < ef || distance < nearest.top().first) {
+                    candidates.push(TCandidate(distance, link));
+                    nearest.push(TCandidate(distance, link));
+                    if (nearest.size() > ef) {
+                        nearest.pop();
+                    }
+                }
+            });
+        }
+
+        std::vector<TCandidate> result(nearest.size());
+        for (size_t i = result.size(); i > 0; --i) {
+            result[i - 1] = nearest.top();
+            nearest.pop();
+        }
+        return result;
+    }
+
+    // keeps a candidate only if it is closer to the base item than to every
+    // link kept so far, which spreads links over different directions
+    std::vector<TItemIndex> SelectLinks(const std::vector<TCandidate>& candidates, const size_t maxLinks) const {
+        std::vector<TItemIndex> links;
+        for (const TCandidate& candidate : candidates) {
+            bool diverse = true;
+            for (const TItemIndex link : links) {
+                if (Metric.Distance(*Items[candidate.second], *Items[link]) < candidate.first) {
+                    diverse = false;
+                    break;
+                }
+            }
+            if (diverse) {
+                links.push_back(candidate.second);
+                if (links.size() == maxLinks) {
+                    break;
+                }
+            }
+        }
+        return links;
+    }
+
+    void Insert(const TItemIndex idx) {
+        const int level = static_cast<int>(Nodes[idx].Layers.size()) - 1;
+        const T& item = *Items[idx];
+
+        // a new top level item is inserted under the entry lock, so that
+        // nobody starts from an entry point it is about to replace
+        std::unique_lock<std::mutex> entryGuard(EntryMutex);
+        const TItemIndex entryPoint = EntryPoint;
+        const int maxLevel = MaxLevel;
+        if (level <= maxLevel) {
+            entryGuard.unlock();
+        }
+
+        TCandidate current(Metric.Distance(item, *Items[entryPoint]), entryPoint);
+        for (int layer = maxLevel; layer > level; --layer) {
+            current = SearchGreedy(item, current, layer, true);
+        }
+
+        for (int layer = std::min(level, maxLevel); layer >= 0; --layer) {
+            const std::vector<TCandidate> found = SearchLayer(item, current, Params.EfConstruction, layer, true);
+            const std::vector<TItemIndex> links = SelectLinks(found, Params.M);
+            {
+                std::lock_guard<std::mutex> guard(NodeMutexes[idx]);
+                Nodes[idx].Layers[layer] = links;
+            }
+
+            for (const TItemIndex link : links) {
+                AddLink(link, idx, layer);
+            }
+            current = found.front();
+        }
+
+        if (level > maxLevel) {
+            EntryPoint = idx;
+            MaxLevel = level;
+        }
+    }
+
+    void AddLink(const TItemIndex from, const TItemIndex to, const int layer) {
+        std::lock_guard<std::mutex> guard(NodeMutexes[from]);
+        std::vector<TItemIndex>& links = Nodes[from].Layers[layer];
+        links.push_back(to);
+
+        const size_t maxLinks = GetMaxLinks(layer);
+        if (links.size() <= maxLinks) {
+            return;
+        }
+
+        std::vector<TCandidate> candidates;
+        for (const TItemIndex link : links) {
+            candidates.push_back(TCandidate(Metric.Distance(*Items[from], *Items[link]), link));
+        }
+        std::sort(candidates.begin(), candidates.end());
+        links = SelectLinks(candidates, maxLinks);
+    }
+};
+
+template <class T, class TMetric>
+constexpr char THnswIndex<T, TMetric>::Magic[8];
@@ -1,78 +1,925 @@
 #include "args.h"
 
 #include "dict.h"
+#include "dict_updater.h"
+#include "features.h"
+#include "model.h"
+#include "pipeline.h"
+#include "reference.h"
+#include "snapshot.h"
 #include "swipe.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <locale>
+#include <map>
+#include <memory>
 #include <codecvt>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
-int main(int argc, const char** argv) {
-    std::string dictPath;
+#include <sys/stat.h>
+
+// 0 for missing files
+static int64_t GetModificationTime(const std::string& path) {
+    struct stat fileStat;
+    if (path.empty() || stat(path.c_str(), &fileStat) != 0) {
+        return 0;
+    }
+    return static_cast<int64_t>(fileStat.st_mtim.tv_sec) * 1000000000 + fileStat.st_mtim.tv_nsec;
+}
+
+static bool ApplyDictUpdates(
+    TKeyboardLayout& layout,
+    TDictSet& dicts,
+    const TDictUpdater::TParams& updaterParams,
+    const std::string& addWordsPath,
+    const std::string& removeWordsPath)
+{
+    if (addWordsPath.empty() && removeWordsPath.empty()) {
+        return true;
+    }
+
+    TDict addedWords;
+    TDict removedWords;
+    if ((!addWordsPath.empty() && !LoadDict(addWordsPath, addedWords)) ||
+        (!removeWordsPath.empty() && !LoadDict(removeWordsPath, removedWords)))
+    {
+        return false;
+    }
+
+    size_t added = 0;
+    size_t removed = 0;
+
+    TDictUpdater updater(layout, dicts, updaterParams);
+    for (const std::string_view word : addedWords.Words) {
+        added += updater.AddWord(word);
+    }
+    for (const std::string_view word : removedWords.Words) {
+        removed += updater.RemoveWord(word);
+    }
+    updater.WaitRebalance();
+
+    std::cerr << "added " << added << " words, removed " << removed << " words, "
+              << updater.GetRebalancesCount() << " re-balances" << std::endl;
+    return true;
+}
+
+// Applies the lines appended to the updates log since offset, "+word" to
+// add a word and "-word" to remove it, and moves offset past the last
+// complete line. A log that got shorter is read again from the start.
+static void ApplyUpdatesLog(TDictUpdater& updater, const std::string& path, uint64_t& offset) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return;
+    }
+    input.seekg(0, std::ios::end);
+    const uint64_t size = input.tellg();
+    if (size < offset) {
+        offset = 0;
+    }
+    input.seekg(offset);
+
+    size_t added = 0;
+    size_t removed = 0;
+    size_t skipped = 0;
+    std::string line;
+    while (std::getline(input, line) && !input.eof()) {
+        offset += line.size() + 1;
+        if (line.size() > 1 && line[0] == '+') {
+            added += updater.AddWord(std::string_view(line).substr(1));
+        } else if (line.size() > 1 && line[0] == '-') {
+            removed += updater.RemoveWord(std::string_view(line).substr(1));
+        } else if (!line.empty()) {
+            ++skipped;
+        }
+    }
+
+    if (added || removed || skipped) {
+        std::cerr << "updates: added " << added << " words, removed " << removed << " words";
+        if (skipped) {
+            std::cerr << ", skipped " << skipped << " lines not starting with + or -";
+        }
+        std::cerr << std::endl;
+    }
+}
+
+static int DecodeMain(int argc, const char** argv) {
     std::string tasksPath;
 
-    size_t clustersLimit = 20;
-    size_t clustersCount = 1000;
-    size_t iterationsCount = 5;
+    TModelParams modelParams;
+    TSearchParams searchParams;
+    TCacheParams cacheParams;
+    TPlacementParams placementParams;
+
+    size_t batchSize = 1;
+
+    std::string userWordsPath;
+    std::string addWordsPath;
+    std::string removeWordsPath;
+    TDictUpdater::TParams updaterParams;
 
     {
         TArgsParser argsParser;
-        argsParser.AddHandler("dict", &dictPath, "path to dictionary").Required();
+        modelParams.AddHandlers(argsParser);
         argsParser.AddHandler("tasks", &tasksPath, "path to tasks").Required();
 
-        argsParser.AddHandler("clusters-limit", &clustersCount, "number of clusters for lookup").Optional();
-        argsParser.AddHandler("clusters-count", &clustersLimit, "number of clusters").Optional();
-        argsParser.AddHandler("iterations", &iterationsCount, "number of iterations").Optional();
+        argsParser.AddHandler("user-words", &userWordsPath, "personal words layered over the dictionary").Optional();
+        argsParser.AddHandler("add-words", &addWordsPath, "words to add to the built model").Optional();
+        argsParser.AddHandler("remove-words", &removeWordsPath, "words to remove from the built model").Optional();
+        updaterParams.AddHandlers(argsParser);
+
+        AddSearchParamsHandlers(argsParser, searchParams);
+        argsParser.AddHandler("batch-size", &batchSize, "number of swipes searched in the cluster index together").Optional();
+
+        cacheParams.AddHandlers(argsParser);
+        placementParams.AddHandlers(argsParser);
 
         argsParser.DoParse(argc, argv);
     }
+    updaterParams.Placement = placementParams;
 
     std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
 
-    TDict dict;
-    {
-        std::ifstream dictIn(dictPath);
-        char line[10000];
-        while (dictIn.getline(line, 10000)) {
-            const std::wstring wideLine = converter.from_bytes(line);
-            dict.Words.push_back(wideLine);
-        }
+    TDictSet dicts;
+    if (!LoadDicts(modelParams, dicts)) {
+        return 1;
     }
 
+    std::unique_ptr<TResultCache> cache = cacheParams.MakeCache();
+
     TKeyboardLayout layout;
+    TDictOverlay overlay;
+
     std::ifstream input(tasksPath);
     char line[100000];
 
     size_t correct = 0;
     size_t processed = 0;
+
+    std::vector<TSwipeEvent> swipeEvents;
+    auto processBatch = [&]() {
+        if (swipeEvents.empty()) {
+            return;
+        }
+
+        const std::vector<std::vector<std::pair<double, std::string_view>>> batchCandidates = batchSize > 1
+            ? dicts.GetCandidates(layout, swipeEvents, searchParams, cache.get(), &overlay)
+            : std::vector<std::vector<std::pair<double, std::string_view>>>(1, dicts.GetCandidates(layout, swipeEvents.front(), searchParams, cache.get(), &overlay));
+
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            // the key filter may leave a swipe without candidates
+            const std::string_view candidate = batchCandidates[i].empty() ? std::string_view() : batchCandidates[i].front().second;
+            if (candidate == EncodeUtf8(swipeEvents[i].Target)) {
+                ++correct;
+            }
+
+            std::cout << candidate << "\n";
+
+            ++processed;
+            if (processed % 10 == 0) {
+                std::cerr << processed << " " << "processed..." << std::endl;
+            }
+        }
+        swipeEvents.clear();
+    };
+
     while (input.getline(line, 100000)) {
         const std::wstring wideLine = converter.from_bytes(line);
 
         if (layout.KeyInfos.empty()) {
-            layout.LoadFromString(wideLine);
-            std::cerr << "making clusters..." << std::endl;
-            layout.MakeClusters(dict, clustersCount, iterationsCount);
-            std::cerr << "building vp tree..." << std::endl;
-            layout.BuildVPTree(dict);
-            std::cerr << "built all!" << std::endl;
+            if (!BuildModel(modelParams, wideLine, layout, dicts)) {
+                return 1;
+            }
+            if (!ApplyDictUpdates(layout, dicts, updaterParams, addWordsPath, removeWordsPath)) {
+                return 1;
+            }
+            if (!userWordsPath.empty() && !LoadOverlay(userWordsPath, layout, overlay)) {
+                return 1;
+            }
+            if (!PlaceModel(placementParams, dicts)) {
+                return 1;
+            }
         }
 
-        const TSwipeEvent swipeEvent = TSwipeEvent::FromString(wideLine);
-        const std::vector<std::pair<double, std::wstring>> candidates = layout.GetCandidates(swipeEvent, dict, clustersLimit);
-        const std::wstring candidate = candidates.front().second;
-        if (candidate == swipeEvent.Target) {
-            ++correct;
+        swipeEvents.push_back(TSwipeEvent::FromString(wideLine));
+        if (swipeEvents.size() >= batchSize) {
+            processBatch();
         }
+    }
+    processBatch();
+
+    std::cerr << "accuracy: " << (double)correct / processed << std::endl;
+    if (cache) {
+        std::cerr << "cache hits: " << cache->GetHits() << ", misses: " << cache->GetMisses() << ", size: " << cache->GetSize() << std::endl;
+    }
+    return 0;
+}
+
+namespace {
+    struct TStreamLine {
+        size_t Seq = 0;
+        std::string Text;
+    };
+
+    struct TStreamSwipe {
+        size_t Seq = 0;
+        TSwipeEvent Event;
+    };
+
+    // A snapshot with the updater its queries and word updates go through.
+    // Declared after the snapshot, the updater is destroyed first and waits
+    // for its re-balance there.
+    struct TServedModel {
+        std::shared_ptr<TModelSnapshot> Snapshot;
+        std::unique_ptr<TDictUpdater> Updater;
+    };
+
+    struct TStreamResult {
+        size_t Seq = 0;
+        // keeps the pools Word points into alive across model reloads
+        std::shared_ptr<const TServedModel> Model;
+        std::string_view Word;
+        bool Correct = false;
+    };
+}
+
+static int StreamMain(int argc, const char** argv) {
+    TModelParams modelParams;
+    TSearchParams searchParams;
+    TCacheParams cacheParams;
+    TPlacementParams placementParams;
+
+    size_t threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    size_t queueSize = 1024;
+
+    std::string userWordsPath;
+    size_t reloadInterval = 0;
+    std::string updatesPath;
+    TDictUpdater::TParams updaterParams;
+
+    {
+        TArgsParser argsParser;
+        modelParams.AddHandlers(argsParser);
+        AddSearchParamsHandlers(argsParser, searchParams);
+        cacheParams.AddHandlers(argsParser);
+        placementParams.AddHandlers(argsParser);
+        updaterParams.AddHandlers(argsParser);
+
+        argsParser.AddHandler("threads", &threadsCount, "number of decoder threads").Optional();
+        argsParser.AddHandler("queue-size", &queueSize, "capacity of each queue between pipeline stages").Optional();
+        argsParser.AddHandler("user-words", &userWordsPath, "personal words layered over the dictionary").Optional();
+        argsParser.AddHandler("reload-interval", &reloadInterval, "seconds between checks for a changed dictionary to rebuild and swap in, 0 to never reload").Optional();
+        argsParser.AddHandler("updates", &updatesPath, "log of +word and -word lines applied to the served model as they are appended").Optional();
+
+        argsParser.DoParse(argc, argv);
+    }
+    updaterParams.Placement = placementParams;
 
-        std::cout << converter.to_bytes(candidate) << "\n";
+    std::ios::sync_with_stdio(false);
 
-        ++processed;
-        if (processed % 10 == 0) {
-            std::cerr << processed << " " << "processed..." << std::endl;
+    // the layout comes with the first task, the model has to be ready before
+    // any swipe can be decoded
+    TStreamLine firstLine;
+    if (!std::getline(std::cin, firstLine.Text)) {
+        return 0;
+    }
+
+    std::wstring layoutLine;
+    {
+        std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+        layoutLine = converter.from_bytes(firstLine.Text);
+    }
+
+    auto getModificationTimes = [&]() {
+        std::vector<int64_t> times;
+        for (const std::string& path : modelParams.GetDictPaths()) {
+            times.push_back(GetModificationTime(path));
+        }
+        times.push_back(GetModificationTime(userWordsPath));
+        return times;
+    };
+    std::vector<int64_t> modificationTimes = getModificationTimes();
+
+    // every model gets the whole updates log, later lines are applied to
+    // the served one as they come
+    uint64_t updatesOffset = 0;
+    int64_t updatesTime = 0;
+    auto makeServedModel = [&]() {
+        std::shared_ptr<TServedModel> served(new TServedModel());
+        served->Snapshot = MakeModelSnapshot(modelParams, cacheParams, placementParams, userWordsPath, layoutLine);
+        if (!served->Snapshot) {
+            return std::shared_ptr<TServedModel>();
+        }
+        TModelSnapshot& snapshot = *served->Snapshot;
+        served->Updater.reset(new TDictUpdater(snapshot.Layout, snapshot.Dicts, updaterParams, snapshot.Cache.get()));
+        if (!updatesPath.empty()) {
+            updatesOffset = 0;
+            updatesTime = GetModificationTime(updatesPath);
+            ApplyUpdatesLog(*served->Updater, updatesPath, updatesOffset);
         }
+        return served;
+    };
+
+    std::shared_ptr<TServedModel> servedModel = makeServedModel();
+    if (!servedModel) {
+        return 1;
     }
+    TSnapshotHolder<const TServedModel> model(servedModel);
 
-    std::cerr << "accuracy: " << (double)correct / processed << std::endl;
+    const size_t nodesCount = placementParams.NumaReplicas ? GetNumaNodesCount() : 0;
+
+    // rebuilds the model off the serving path and swaps it in, decoders go
+    // on with the old one meanwhile; appended updates are applied in place
+    std::atomic<bool> stopReloading(false);
+    std::thread reloader([&]() {
+        if (!reloadInterval && updatesPath.empty()) {
+            return;
+        }
+
+        size_t version = 1;
+        auto nextCheck = std::chrono::steady_clock::now() + std::chrono::seconds(reloadInterval);
+        while (!stopReloading) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+            const int64_t currentUpdatesTime = GetModificationTime(updatesPath);
+            if (currentUpdatesTime != updatesTime) {
+                updatesTime = currentUpdatesTime;
+                ApplyUpdatesLog(*servedModel->Updater, updatesPath, updatesOffset);
+            }
+
+            if (!reloadInterval || std::chrono::steady_clock::now() < nextCheck) {
+                continue;
+            }
+            nextCheck = std::chrono::steady_clock::now() + std::chrono::seconds(reloadInterval);
+
+            const std::vector<int64_t> currentTimes = getModificationTimes();
+            if (currentTimes == modificationTimes) {
+                continue;
+            }
+            modificationTimes = currentTimes;
+
+            std::shared_ptr<TServedModel> reloaded = makeServedModel();
+            if (!reloaded) {
+                std::cerr << "model reload failed, serving version " << version << std::endl;
+                continue;
+            }
+            const size_t wordsCount = reloaded->Snapshot->Dicts.GetWordsCount();
+            servedModel = reloaded;
+            model.Publish(std::move(reloaded));
+            std::cerr << "reloaded model version " << ++version << ": " << wordsCount << " words" << std::endl;
+        }
+    });
+
+    TBoundedQueue<TStreamLine> lines(queueSize);
+    TBoundedQueue<TStreamSwipe> swipes(queueSize);
+    TBoundedQueue<TStreamResult> results(queueSize);
+
+    std::thread reader([&]() {
+        lines.Push(std::move(firstLine));
+
+        TStreamLine line;
+        line.Seq = 1;
+        while (std::getline(std::cin, line.Text)) {
+            const size_t seq = line.Seq;
+            lines.Push(std::move(line));
+            line = TStreamLine();
+            line.Seq = seq + 1;
+        }
+        lines.Close();
+    });
+
+    std::thread parser([&]() {
+        std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+
+        TStreamLine line;
+        while (lines.Pop(line)) {
+            TStreamSwipe swipe;
+            swipe.Seq = line.Seq;
+            swipe.Event = TSwipeEvent::FromString(converter.from_bytes(line.Text));
+            swipes.Push(std::move(swipe));
+        }
+        swipes.Close();
+    });
+
+    std::atomic<size_t> runningDecoders(threadsCount);
+    std::vector<std::thread> decoders;
+    for (size_t i = 0; i < threadsCount; ++i) {
+        decoders.emplace_back([&, i]() {
+            if (nodesCount) {
+                PinThreadToNumaNode(i % nodesCount);
+            }
+
+            TStreamSwipe swipe;
+            while (swipes.Pop(swipe)) {
+                TStreamResult result;
+                result.Seq = swipe.Seq;
+                if (!swipe.Event.Points.empty()) {
+                    result.Model = model.Get();
+                    const TServedModel& served = *result.Model;
+                    const std::vector<std::pair<double, std::string_view>> candidates = served.Updater->GetCandidates(swipe.Event, searchParams, &served.Snapshot->Overlay);
+                    result.Word = candidates.empty() ? std::string_view() : candidates.front().second;
+                    result.Correct = result.Word == EncodeUtf8(swipe.Event.Target);
+                }
+                results.Push(std::move(result));
+            }
+
+            if (--runningDecoders == 0) {
+                results.Close();
+            }
+        });
+    }
+
+    // results arrive out of order, the writer holds them back until all
+    // previous lines are written and flushes whenever it runs out of input
+    size_t correct = 0;
+    size_t processed = 0;
+
+    std::map<size_t, TStreamResult> pending;
+    TStreamResult result;
+    for (;;) {
+        if (!results.TryPop(result)) {
+            std::cout.flush();
+            if (!results.Pop(result)) {
+                break;
+            }
+        }
+
+        pending[result.Seq] = std::move(result);
+        result = TStreamResult();
+        for (auto it = pending.begin(); it != pending.end() && it->first == processed; it = pending.erase(it)) {
+            std::cout << it->second.Word << "\n";
+            correct += it->second.Correct;
+            ++processed;
+        }
+    }
+    std::cout.flush();
+
+    reader.join();
+    parser.join();
+    for (std::thread& decoder : decoders) {
+        decoder.join();
+    }
+    stopReloading = true;
+    reloader.join();
+
+    std::cerr << "processed: " << processed << ", accuracy: " << (double)correct / std::max<size_t>(1, processed) << std::endl;
+    const std::shared_ptr<const TServedModel> finalModel = model.Get();
+    if (const TResultCache* cache = finalModel->Snapshot->Cache.get()) {
+        std::cerr << "cache hits: " << cache->GetHits() << ", misses: " << cache->GetMisses() << ", size: " << cache->GetSize() << std::endl;
+    }
+    return 0;
+}
+
+static int CompareIndexMain(int argc, const char** argv) {
+    std::string tasksPath;
+
+    TModelParams modelParams;
+    TSearchParams searchParams;
+
+    {
+        TArgsParser argsParser;
+        modelParams.AddHandlers(argsParser);
+        AddSearchParamsHandlers(argsParser, searchParams);
+        argsParser.AddHandler("tasks", &tasksPath, "path to tasks").Required();
+
+        argsParser.DoParse(argc, argv);
+    }
+
+    // the first dictionary only
+    TDict dict;
+    if (!LoadDict(modelParams.GetDictPaths().front(), dict)) {
+        return 1;
+    }
+
+    std::ifstream input(tasksPath);
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+
+    TKeyboardLayout layout;
+    std::vector<TSwipeEvent> swipeEvents;
+    std::string line;
+    while (std::getline(input, line)) {
+        const std::wstring wideLine = converter.from_bytes(line);
+        if (layout.KeyInfos.empty() && !BuildModel(modelParams, wideLine, layout, dict)) {
+            return 1;
+        }
+        swipeEvents.push_back(TSwipeEvent::FromString(wideLine));
+    }
+    if (swipeEvents.empty()) {
+        return 0;
+    }
+
+    // exact nearest clusters by a full scan of the centers
+    const size_t k = std::min(searchParams.ClustersLimit, dict.ClusterEmbeddings.size());
+    std::vector<TShortEmbedding> queries(swipeEvents.size());
+    std::vector<std::vector<unsigned int>> exact(swipeEvents.size());
+    for (size_t i = 0; i < swipeEvents.size(); ++i) {
+        queries[i].Coords = dict.ShortenEmbedding(layout.MakePoints(swipeEvents[i]));
+
+        std::vector<std::pair<double, unsigned int>> distances;
+        for (const TShortEmbedding& cluster : dict.ClusterEmbeddings) {
+            distances.push_back(std::make_pair(dict.Kernels->ShortDistance(queries[i].Coords, cluster.Coords), cluster.Idx));
+        }
+        std::partial_sort(distances.begin(), distances.begin() + k, distances.end());
+        for (size_t j = 0; j < k; ++j) {
+            exact[i].push_back(distances[j].second);
+        }
+        std::sort(exact[i].begin(), exact[i].end());
+    }
+
+    std::cout << "index\tbuild ms\trecall@" << k << "\tfound\tsearch us\taccuracy\tdecode us" << std::endl;
+    for (const std::string type : {"vp-tree", "hnsw"}) {
+        TClusterIndexParams indexParams = modelParams.Index;
+        indexParams.Type = type;
+
+        const auto buildStart = std::chrono::steady_clock::now();
+        dict.ClusterIndex = MakeClusterIndex(indexParams, dict.ClusterEmbeddings, layout.Kernels);
+        const double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+
+        size_t hits = 0;
+        size_t foundCount = 0;
+        const auto searchStart = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < queries.size(); ++i) {
+            const std::vector<TShortEmbedding*> found = dict.ClusterIndex->FindClusters(queries[i], searchParams.ClustersLimit);
+            foundCount += found.size();
+            for (const TShortEmbedding* cluster : found) {
+                hits += std::binary_search(exact[i].begin(), exact[i].end(), cluster->Idx);
+            }
+        }
+        const double searchUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - searchStart).count();
+
+        size_t correct = 0;
+        const auto decodeStart = std::chrono::steady_clock::now();
+        for (const TSwipeEvent& swipeEvent : swipeEvents) {
+            const std::vector<std::pair<double, std::string_view>> candidates = layout.GetCandidates(swipeEvent, dict, searchParams);
+            correct += !candidates.empty() && candidates.front().second == EncodeUtf8(swipeEvent.Target);
+        }
+        const double decodeUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - decodeStart).count();
+
+        std::cout << type << "\t"
+                  << buildMs << "\t"
+                  << (double)hits / std::max<size_t>(1, k * queries.size()) << "\t"
+                  << (double)foundCount / queries.size() << "\t"
+                  << searchUs / queries.size() << "\t"
+                  << (double)correct / swipeEvents.size() << "\t"
+                  << decodeUs / swipeEvents.size() << std::endl;
+    }
+    return 0;
+}
+
+static int VerifyMain(int argc, const char** argv) {
+    std::string tasksPath;
+
+    TModelParams modelParams;
+    TSearchParams searchParams;
+
+    size_t syntheticCount = 1000;
+    double syntheticNoise = 0.25;
+    uint64_t seed = 0;
+    size_t batchSize = 16;
+
+    double scoreTolerance = 1e-9;
+    double minRecall = 0.9;
+    double minTopAgreement = 0.95;
+    std::string detailsPath;
+
+    {
+        TArgsParser argsParser;
+        modelParams.AddHandlers(argsParser);
+        AddSearchParamsHandlers(argsParser, searchParams);
+        argsParser.AddHandler("tasks", &tasksPath, "path to tasks").Required();
+
+        argsParser.AddHandler("synthetic-count", &syntheticCount, "number of synthetic swipes through random dict words").Optional();
+        argsParser.AddHandler("synthetic-noise", &syntheticNoise, "deviation of synthetic swipe points in key widths").Optional();
+        argsParser.AddHandler("seed", &seed, "seed of synthetic swipes").Optional();
+        argsParser.AddHandler("batch-size", &batchSize, "number of swipes decoded together on the batched path").Optional();
+
+        argsParser.AddHandler("score-tolerance", &scoreTolerance, "max relative difference of a candidate score from its reference score").Optional();
+        argsParser.AddHandler("min-recall", &minRecall, "min mean share of reference top words found by the optimized decoder").Optional();
+        argsParser.AddHandler("min-top1-agreement", &minTopAgreement, "min share of swipes where the optimized decoder puts the reference top word first").Optional();
+        argsParser.AddHandler("details", &detailsPath, "file for per-swipe results").Optional();
+
+        argsParser.DoParse(argc, argv);
+    }
+
+    // the first dictionary only
+    TDict dict;
+    if (!LoadDict(modelParams.GetDictPaths().front(), dict)) {
+        return 1;
+    }
+
+    std::ifstream input(tasksPath);
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+
+    TKeyboardLayout layout;
+    std::vector<TSwipeEvent> trainEvents;
+    std::string line;
+    while (std::getline(input, line)) {
+        const std::wstring wideLine = converter.from_bytes(line);
+        if (layout.KeyInfos.empty() && !BuildModel(modelParams, wideLine, layout, dict)) {
+            return 1;
+        }
+        trainEvents.push_back(TSwipeEvent::FromString(wideLine));
+    }
+    if (trainEvents.empty()) {
+        return 0;
+    }
+
+    std::mt19937_64 random(seed);
+    const std::vector<TSwipeEvent> syntheticEvents = MakeSyntheticSwipes(layout, dict, syntheticCount, syntheticNoise, random);
+
+    const TReferenceDecoder reference(layout, dict);
+
+    std::ofstream details;
+    if (!detailsPath.empty()) {
+        details.open(detailsPath);
+        details << "set\tswipe\ttarget\treference\toptimized\tmax score delta\trecall" << std::endl;
+    }
+
+    using TCandidates = std::vector<std::pair<double, std::string_view>>;
+    using TClock = std::chrono::steady_clock;
+    auto elapsedUs = [](const TClock::time_point start) {
+        return std::chrono::duration<double, std::micro>(TClock::now() - start).count();
+    };
+
+    bool failed = false;
+
+    std::cout << "set\tswipes\ttop-1 agreement\trecall@" << searchParams.TopSize << "\tmax score delta\tbatch mismatches"
+              << "\tindex recall\tindex speedup\tdecode speedup\tbatch speedup" << std::endl;
+    const std::vector<std::pair<std::string, const std::vector<TSwipeEvent>*>> sets = {
+        {"train", &trainEvents},
+        {"synthetic", &syntheticEvents}
+    };
+    for (const auto& set : sets) {
+        const std::vector<TSwipeEvent>& swipeEvents = *set.second;
+        if (swipeEvents.empty()) {
+            continue;
+        }
+
+        std::vector<std::vector<TCoord>> points(swipeEvents.size());
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            points[i] = layout.MakePoints(swipeEvents[i]);
+        }
+
+        std::vector<TCandidates> referenceCandidates(swipeEvents.size());
+        TClock::time_point start = TClock::now();
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            referenceCandidates[i] = reference.GetCandidates(points[i], searchParams.TopSize);
+        }
+        const double referenceUs = elapsedUs(start);
+
+        std::vector<TCandidates> candidates(swipeEvents.size());
+        start = TClock::now();
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            candidates[i] = layout.GetCandidates(swipeEvents[i], dict, searchParams);
+        }
+        const double optimizedUs = elapsedUs(start);
+
+        std::vector<TCandidates> batchCandidates;
+        start = TClock::now();
+        for (size_t begin = 0; begin < swipeEvents.size(); begin += std::max<size_t>(batchSize, 1)) {
+            const std::vector<TSwipeEvent> batch(swipeEvents.begin() + begin, swipeEvents.begin() + std::min(begin + std::max<size_t>(batchSize, 1), swipeEvents.size()));
+            for (TCandidates& batchResult : layout.GetCandidates(batch, dict, searchParams)) {
+                batchCandidates.push_back(std::move(batchResult));
+            }
+        }
+        const double batchUs = elapsedUs(start);
+
+        // cluster index against the full scan of the centers
+        const size_t clustersLimit = std::min(searchParams.ClustersLimit, dict.ClusterEmbeddings.size());
+        std::vector<std::vector<size_t>> referenceClusters(swipeEvents.size());
+        start = TClock::now();
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            referenceClusters[i] = reference.FindClusters(points[i], clustersLimit);
+            std::sort(referenceClusters[i].begin(), referenceClusters[i].end());
+        }
+        const double referenceIndexUs = elapsedUs(start);
+
+        std::vector<TShortEmbedding> queries(swipeEvents.size());
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            queries[i].Coords = dict.ShortenEmbedding(points[i]);
+        }
+        size_t clusterHits = 0;
+        start = TClock::now();
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            for (const TShortEmbedding* cluster : dict.ClusterIndex->FindClusters(queries[i], clustersLimit)) {
+                clusterHits += std::binary_search(referenceClusters[i].begin(), referenceClusters[i].end(), cluster->Idx);
+            }
+        }
+        const double indexUs = elapsedUs(start);
+
+        size_t topAgreements = 0;
+        size_t batchMismatches = 0;
+        double maxScoreDelta = 0.;
+        TMeanCalculator recall;
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            double swipeScoreDelta = 0.;
+            for (const std::pair<double, std::string_view>& candidate : candidates[i]) {
+                const double referenceScore = reference.ScoreWord(candidate.second, points[i]);
+                swipeScoreDelta = std::max(swipeScoreDelta, std::abs(candidate.first - referenceScore) / std::max(1., std::abs(referenceScore)));
+            }
+            maxScoreDelta = std::max(maxScoreDelta, swipeScoreDelta);
+
+            std::vector<std::string_view> referenceWords;
+            for (const std::pair<double, std::string_view>& candidate : referenceCandidates[i]) {
+                referenceWords.push_back(candidate.second);
+            }
+            std::vector<std::string_view> words;
+            for (const std::pair<double, std::string_view>& candidate : candidates[i]) {
+                words.push_back(candidate.second);
+            }
+            std::sort(referenceWords.begin(), referenceWords.end());
+            std::sort(words.begin(), words.end());
+            std::vector<std::string_view> common;
+            std::set_intersection(referenceWords.begin(), referenceWords.end(), words.begin(), words.end(), std::back_inserter(common));
+            const double swipeRecall = referenceWords.empty() ? 1. : (double)common.size() / referenceWords.size();
+            recall.Add(swipeRecall);
+
+            const std::string_view referenceTop = referenceCandidates[i].empty() ? std::string_view() : referenceCandidates[i].front().second;
+            const std::string_view top = candidates[i].empty() ? std::string_view() : candidates[i].front().second;
+            topAgreements += referenceTop == top;
+
+            batchMismatches += batchCandidates[i] != candidates[i];
+
+            if (details.is_open()) {
+                details << set.first << "\t" << i << "\t" << EncodeUtf8(swipeEvents[i].Target) << "\t"
+                        << referenceTop << "\t" << top << "\t" << swipeScoreDelta << "\t" << swipeRecall << "\n";
+            }
+        }
+
+        const double topAgreement = (double)topAgreements / swipeEvents.size();
+        std::cout << set.first << "\t"
+                  << swipeEvents.size() << "\t"
+                  << topAgreement << "\t"
+                  << recall.GetMean() << "\t"
+                  << maxScoreDelta << "\t"
+                  << batchMismatches << "\t"
+                  << (double)clusterHits / std::max<size_t>(1, clustersLimit * swipeEvents.size()) << "\t"
+                  << referenceIndexUs / std::max(indexUs, 1e-3) << "\t"
+                  << referenceUs / std::max(optimizedUs, 1e-3) << "\t"
+                  << referenceUs / std::max(batchUs, 1e-3) << std::endl;
+
+        if (maxScoreDelta > scoreTolerance) {
+            std::cerr << set.first << ": candidate scores differ from reference scores by " << maxScoreDelta << std::endl;
+            failed = true;
+        }
+        if (batchMismatches) {
+            std::cerr << set.first << ": batched decoding differs from single swipe decoding on " << batchMismatches << " swipes" << std::endl;
+            failed = true;
+        }
+        if (recall.GetMean() < minRecall) {
+            std::cerr << set.first << ": recall " << recall.GetMean() << " is below " << minRecall << std::endl;
+            failed = true;
+        }
+        if (topAgreement < minTopAgreement) {
+            std::cerr << set.first << ": top-1 agreement " << topAgreement << " is below " << minTopAgreement << std::endl;
+            failed = true;
+        }
+    }
+
+    std::cerr << (failed ? "verification failed" : "verification passed") << std::endl;
+    return failed ? 1 : 0;
+}
+
+// Columnar output for training rerankers: the magic "SWFEAT01", uint64
+// rows and features counts, NUL-terminated feature names, then the columns
+// one after another: uint32 swipe numbers, uint8 labels (1 for the target
+// word), NUL-terminated candidate words and a float32 column per feature.
+static int FeaturesMain(int argc, const char** argv) {
+    std::string tasksPath;
+    std::string outputPath;
+
+    TModelParams modelParams;
+    TSearchParams searchParams;
+    TPlacementParams placementParams;
+    size_t threadsCount = std::max(1u, std::thread::hardware_concurrency());
+
+    {
+        TArgsParser argsParser;
+        modelParams.AddHandlers(argsParser);
+        placementParams.AddHandlers(argsParser);
+        AddSearchParamsHandlers(argsParser, searchParams);
+        argsParser.AddHandler("tasks", &tasksPath, "path to tasks").Required();
+        argsParser.AddHandler("output", &outputPath, "file for the features").Required();
+        argsParser.AddHandler("candidates", &searchParams.TopSize, "number of candidates per swipe").Optional();
+        argsParser.AddHandler("threads", &threadsCount, "number of threads extracting features").Optional();
+
+        argsParser.DoParse(argc, argv);
+    }
+
+    // the first dictionary only
+    TDict dict;
+    if (!LoadDict(modelParams.GetDictPaths().front(), dict)) {
+        return 1;
+    }
+
+    std::ifstream input(tasksPath);
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+
+    TKeyboardLayout layout;
+    std::vector<TSwipeEvent> swipeEvents;
+    std::string line;
+    while (std::getline(input, line)) {
+        const std::wstring wideLine = converter.from_bytes(line);
+        if (layout.KeyInfos.empty() && !BuildModel(modelParams, wideLine, layout, dict)) {
+            return 1;
+        }
+        swipeEvents.push_back(TSwipeEvent::FromString(wideLine));
+    }
+    if (!layout.KeyInfos.empty() && !PlaceModel(placementParams, dict)) {
+        return 1;
+    }
+
+    const TFeatureExtractor extractor(layout, dict);
+    const uint64_t allFeatures = (uint64_t(1) << FeaturesCount) - 1;
+
+    std::vector<std::vector<std::pair<double, std::string_view>>> candidates(swipeEvents.size());
+    std::vector<std::vector<float>> features(swipeEvents.size());
+
+    const auto start = std::chrono::steady_clock::now();
+    const size_t chunkSize = 256;
+    TThreadPool pool(threadsCount > 1 ? threadsCount - 1 : 0, placementParams.NumaReplicas ? GetNumaNodesCount() : 0);
+    pool.ParallelFor((swipeEvents.size() + chunkSize - 1) / chunkSize, [&](const size_t chunk) {
+        const size_t end = std::min(swipeEvents.size(), (chunk + 1) * chunkSize);
+        for (size_t i = chunk * chunkSize; i < end; ++i) {
+            const std::vector<TCoord> points = layout.MakePoints(swipeEvents[i]);
+            TShortEmbedding shortEmbedding;
+            shortEmbedding.Coords = dict.ShortenEmbedding(points);
+
+            candidates[i] = layout.GetCandidates(points, shortEmbedding, dict, searchParams);
+            extractor.Extract(points, shortEmbedding, candidates[i], searchParams.ClustersLimit, allFeatures, features[i]);
+        }
+    });
+    const double extractSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::ofstream out(outputPath, std::ios::binary);
+    if (!out) {
+        std::cerr << "cannot open output " << outputPath << std::endl;
+        return 1;
+    }
+    auto write = [&](const auto& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+
+    uint64_t rowsCount = 0;
+    for (const auto& swipeCandidates : candidates) {
+        rowsCount += swipeCandidates.size();
+    }
+    out.write("SWFEAT01", 8);
+    write(rowsCount);
+    write(static_cast<uint64_t>(FeaturesCount));
+    for (size_t feature = 0; feature < FeaturesCount; ++feature) {
+        out << GetFeatureName(feature) << '\0';
+    }
+
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        for (size_t j = 0; j < candidates[i].size(); ++j) {
+            write(static_cast<uint32_t>(i));
+        }
+    }
+    size_t found = 0;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        const std::string target = EncodeUtf8(swipeEvents[i].Target);
+        for (const auto& candidate : candidates[i]) {
+            const uint8_t label = candidate.second == target;
+            write(label);
+            found += label;
+        }
+    }
+    for (const auto& swipeCandidates : candidates) {
+        for (const auto& candidate : swipeCandidates) {
+            out << candidate.second << '\0';
+        }
+    }
+    for (size_t feature = 0; feature < FeaturesCount; ++feature) {
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            const size_t count = candidates[i].size();
+            out.write(reinterpret_cast<const char*>(features[i].data() + feature * count), count * sizeof(float));
+        }
+    }
+    if (!out) {
+        std::cerr << "cannot write output " << outputPath << std::endl;
+        return 1;
+    }
+
+    std::cerr << "swipes: " << swipeEvents.size() << ", rows: " << rowsCount
+              << ", targets among candidates: " << (double)found / std::max<size_t>(1, swipeEvents.size())
+              << ", extracted in " << extractSeconds << " s on " << std::max<size_t>(1, threadsCount) << " thread(s)" << std::endl;
+    return 0;
+}
+
+int main(int argc, const char** argv) {
+    TModeChooser modeChooser;
+    modeChooser.Add("decode", &DecodeMain, "decode a tasks file and report accuracy");
+    modeChooser.Add("stream", &StreamMain, "decode tasks from stdin in a pipeline, writing answers as they are ready");
+    modeChooser.Add("compare-index", &CompareIndexMain, "compare cluster indexes in recall and latency on a tasks file");
+    modeChooser.Add("verify", &VerifyMain, "check optimized decoding against the reference decoder on a tasks file and synthetic swipes");
+    modeChooser.Add("features", &FeaturesMain, "write candidates of a tasks file with their features for reranker training");
+    return modeChooser.Run(argc, argv);
 }
@@ -0,0 +1,316 @@
+#include "model.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace {
+    std::vector<std::string> SplitList(const std::string& list) {
+        std::vector<std::string> items;
+        std::stringstream ss(list);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            items.push_back(item);
+        }
+        return items;
+    }
+}
+
+void TModelParams::AddHandlers(TArgsParser& argsParser) {
+    argsParser.AddHandler("dict", &DictPath, "path to dictionary, comma-separated paths to decode several at once").Required();
+    argsParser.AddHandler("dict-offsets", &DictOffsets, "comma-separated scores added to candidates of each dictionary").Optional();
+
+    argsParser.AddHandler("clusters-count", &ClustersCount, "number of clusters").Optional();
+    argsParser.AddHandler("max-cluster-size", &MaxClusterSize, "balanced clustering size cap, 0 for plain k-means").Optional();
+    argsParser.AddHandler("iterations", &IterationsCount, "max number of iterations").Optional();
+    argsParser.AddHandler("max-churn", &MaxChurn, "stop iterating once an iteration moves at most this share of words to other clusters").Optional();
+    argsParser.AddHandler("centers-path", &CentersPath, "file to warm-start clustering from and save cluster centers to").Optional();
+    argsParser.AddHandler("mini-batch-size", &MiniBatchSize, "words per mini-batch k-means step, 0 for full k-means").Optional();
+    argsParser.AddHandler("mini-batch-iterations", &MiniBatchIterations, "number of mini-batch k-means steps").Optional();
+
+    argsParser.AddHandler("collapse-repeats", &CollapseRepeatedKeys, "1 to encode a key repeated in a row once, so such words share key paths").Optional();
+
+    argsParser.AddHandler("embedding-length", &EmbeddingLength, "number of points in word and swipe embeddings").Optional();
+    argsParser.AddHandler("short-embedding-length", &ShortEmbeddingLength, "number of points in short embeddings used for clustering").Optional();
+
+    argsParser.AddHandler("storage-path", &StoragePath, "file for out-of-core cluster storage, empty to keep clusters in memory").Optional();
+    argsParser.AddHandler("reuse-storage", &ReuseStorage, "1 to open the cluster storage file left by an earlier run for the same words and layout instead of clustering").Optional();
+
+    argsParser.AddHandler("cluster-index", &Index.Type, "cluster index: vp-tree or hnsw").Optional();
+    argsParser.AddHandler("index-path", &IndexPath, "file to load the hnsw graph from or save it to").Optional();
+    argsParser.AddHandler("hnsw-m", &Index.HnswM, "max hnsw links per cluster on upper layers").Optional();
+    argsParser.AddHandler("hnsw-ef-construction", &Index.HnswEfConstruction, "hnsw candidates list size while building").Optional();
+    argsParser.AddHandler("hnsw-ef", &Index.HnswEfSearch, "hnsw candidates list size while searching").Optional();
+    argsParser.AddHandler("hnsw-threads", &Index.HnswThreads, "threads building the hnsw graph, 0 for all").Optional();
+
+    argsParser.AddHandler("pq-segments", &QuantizerSegments, "number of product quantization segments, 0 to disable").Optional();
+    argsParser.AddHandler("pq-samples", &QuantizerSamples, "number of words to train product quantization codebooks on").Optional();
+    argsParser.AddHandler("pq-iterations", &QuantizerIterations, "number of k-means iterations for product quantization codebooks").Optional();
+
+    argsParser.AddHandler("reranker", &RerankerPath, "file with linear reranker weights, empty to rank by score").Optional();
+}
+
+std::vector<std::string> TModelParams::GetDictPaths() const {
+    return SplitList(DictPath);
+}
+
+void TCacheParams::AddHandlers(TArgsParser& argsParser) {
+    argsParser.AddHandler("cache-size", &Size, "number of cached swipe results, 0 to disable the cache").Optional();
+    argsParser.AddHandler("cache-grid", &Grid, "cache key grid step as a fraction of key width").Optional();
+}
+
+std::unique_ptr<TResultCache> TCacheParams::MakeCache() const {
+    if (!Size) {
+        return nullptr;
+    }
+    return std::unique_ptr<TResultCache>(new TResultCache(Size, Grid));
+}
+
+void TPlacementParams::AddHandlers(TArgsParser& argsParser) {
+    argsParser.AddHandler("huge-pages", &HugePages, "1 to back packed cluster storage with 2 MB pages; cluster index and word tables stay on regular pages").Optional();
+    argsParser.AddHandler("numa-replicas", &NumaReplicas, "1 to replicate packed cluster storage on every NUMA node and pin workers to nodes; cluster index and word tables are not replicated").Optional();
+}
+
+void AddSearchParamsHandlers(TArgsParser& argsParser, TSearchParams& searchParams) {
+    argsParser.AddHandler("clusters-limit", &searchParams.ClustersLimit, "number of clusters for lookup").Optional();
+    argsParser.AddHandler("words-budget", &searchParams.WordsBudget, "max words scored per swipe, 0 for no limit").Optional();
+    argsParser.AddHandler("prefetch-clusters", &searchParams.PrefetchClusters, "number of clusters to prefetch ahead of probing").Optional();
+    argsParser.AddHandler("rescore-count", &searchParams.RescoreCount, "candidates rescored exactly after product quantization ranking, 0 to score all exactly").Optional();
+    argsParser.AddHandler("key-filter-radius", &searchParams.KeyFilterRadius, "skip words needing keys farther than this many key widths from the swipe, 0 to disable").Optional();
+    argsParser.AddHandler("key-filter-misses", &searchParams.KeyFilterMisses, "number of unreachable keys a word may need and still be scored").Optional();
+    argsParser.AddHandler("rerank-count", &searchParams.RerankCount, "candidates of each dictionary rescored by the reranker, 0 for the top size").Optional();
+}
+
+bool LoadDict(const std::string& dictPath, TDict& dict) {
+    std::ifstream dictIn(dictPath);
+    if (!dictIn) {
+        std::cerr << "cannot open dictionary " << dictPath << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(dictIn, line)) {
+        dict.Words.Add(line);
+    }
+    return true;
+}
+
+bool LoadDicts(const TModelParams& params, TDictSet& dicts) {
+    const std::vector<std::string> paths = params.GetDictPaths();
+    if (paths.empty()) {
+        std::cerr << "no dictionaries given" << std::endl;
+        return false;
+    }
+
+    for (const std::string& path : paths) {
+        dicts.Dicts.emplace_back(new TDict());
+        if (!LoadDict(path, *dicts.Dicts.back())) {
+            return false;
+        }
+    }
+
+    dicts.ScoreOffsets.assign(paths.size(), 0.);
+    const std::vector<std::string> offsets = SplitList(params.DictOffsets);
+    if (!offsets.empty() && offsets.size() != paths.size()) {
+        std::cerr << "got " << offsets.size() << " dictionary offsets for " << paths.size() << " dictionaries" << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        dicts.ScoreOffsets[i] = std::stod(offsets[i]);
+    }
+
+    if (paths.size() > 1) {
+        dicts.Pool.reset(new TThreadPool(paths.size() - 1));
+    }
+    return true;
+}
+
+bool LoadOverlay(const std::string& wordsPath, const TKeyboardLayout& layout, TDictOverlay& overlay) {
+    TDict userDict;
+    if (!LoadDict(wordsPath, userDict)) {
+        return false;
+    }
+    for (const std::string_view word : userDict.Words) {
+        layout.AddWord(overlay, word);
+    }
+    std::cerr << "user words: " << overlay.Words.GetSize() << std::endl;
+    return true;
+}
+
+static bool LoadLayout(const TModelParams& params, const std::wstring& layoutLine, TKeyboardLayout& layout) {
+    layout.Kernels = FindEmbeddingKernels(params.EmbeddingLength, params.ShortEmbeddingLength);
+    if (!layout.Kernels) {
+        std::cerr << "unsupported embedding lengths: " << params.EmbeddingLength << ", " << params.ShortEmbeddingLength << std::endl;
+        std::cerr << "supported lengths: " << SupportedEmbeddingLengths() << " (short length must not exceed embedding length)" << std::endl;
+        return false;
+    }
+
+    layout.LoadFromString(layoutLine);
+    layout.CollapseRepeatedKeys = params.CollapseRepeatedKeys;
+    layout.IndexParams = params.Index;
+    return true;
+}
+
+static bool BuildDictModel(const TModelParams& params, const TKeyboardLayout& layout, TDict& dict) {
+    if (params.ReuseStorage && !params.StoragePath.empty() && layout.OpenClusterStorage(dict, params.StoragePath)) {
+        std::cerr << "reusing cluster storage, clustering skipped" << std::endl;
+    } else {
+        std::cerr << "making clusters..." << std::endl;
+        if (params.MiniBatchSize) {
+            layout.MakeClustersMiniBatch(dict, params.ClustersCount, params.MiniBatchIterations, params.MiniBatchSize, params.MaxClusterSize);
+        } else {
+            dict.Kernels = layout.Kernels;
+            const bool warmStart = !params.CentersPath.empty() && dict.LoadClusterCenters(params.CentersPath, params.ClustersCount);
+            if (warmStart) {
+                std::cerr << "loaded " << dict.ClusterCenters.size() << " cluster centers from " << params.CentersPath << std::endl;
+            }
+            layout.MakeClusters(dict, params.ClustersCount, params.IterationsCount, params.MaxClusterSize, params.MaxChurn, warmStart);
+        }
+        std::cerr << "building cluster storage..." << std::endl;
+        if (!layout.BuildClusterStorage(dict, params.StoragePath)) {
+            return false;
+        }
+    }
+    if (!params.CentersPath.empty() && !dict.SaveClusterCenters(params.CentersPath)) {
+        std::cerr << "cannot save cluster centers to " << params.CentersPath << std::endl;
+    }
+    if (params.QuantizerSegments) {
+        std::cerr << "training product quantizer..." << std::endl;
+        if (!layout.TrainQuantizer(dict, params.QuantizerSegments, params.QuantizerSamples, params.QuantizerIterations)) {
+            std::cerr << "no words to train product quantizer on, scoring exactly" << std::endl;
+        }
+    }
+    std::cerr << "building " << params.Index.Type << " cluster index..." << std::endl;
+    if (!layout.BuildClusterIndex(dict, params.IndexPath)) {
+        return false;
+    }
+    std::cerr << "built all!" << std::endl;
+    return true;
+}
+
+bool BuildModel(const TModelParams& params, const std::wstring& layoutLine, TKeyboardLayout& layout, TDict& dict) {
+    return LoadLayout(params, layoutLine, layout) && BuildDictModel(params, layout, dict);
+}
+
+bool BuildModel(const TModelParams& params, const std::wstring& layoutLine, TKeyboardLayout& layout, TDictSet& dicts) {
+    if (!LoadLayout(params, layoutLine, layout)) {
+        return false;
+    }
+    for (size_t dictIdx = 0; dictIdx < dicts.Dicts.size(); ++dictIdx) {
+        TModelParams dictParams = params;
+        if (dictIdx) {
+            const std::string suffix = "." + std::to_string(dictIdx);
+            dictParams.StoragePath += dictParams.StoragePath.empty() ? "" : suffix;
+            dictParams.IndexPath += dictParams.IndexPath.empty() ? "" : suffix;
+            dictParams.CentersPath += dictParams.CentersPath.empty() ? "" : suffix;
+        }
+        if (!BuildDictModel(dictParams, layout, *dicts.Dicts[dictIdx])) {
+            return false;
+        }
+    }
+
+    if (!params.RerankerPath.empty()) {
+        dicts.Reranker.reset(new TLinearReranker());
+        if (!dicts.Reranker->Load(params.RerankerPath)) {
+            return false;
+        }
+        dicts.Extractors.clear();
+        for (const std::unique_ptr<TDict>& dict : dicts.Dicts) {
+            dicts.Extractors.emplace_back(new TFeatureExtractor(layout, *dict));
+        }
+    }
+    return true;
+}
+
+bool PlaceModel(const TPlacementParams& params, TDict& dict) {
+    if (!params.HugePages && !params.NumaReplicas) {
+        return true;
+    }
+    if (dynamic_cast<const TMappedClusterStorage*>(dict.Storage.get())) {
+        std::cerr << "placement: mapped cluster storage stays file-backed, nothing is replicated or put on huge pages" << std::endl;
+        return true;
+    }
+
+    const size_t nodesCount = params.NumaReplicas ? GetNumaNodesCount() : 1;
+
+    // every replica is copied by a thread on its node, so first touch puts
+    // the pages there
+    std::vector<std::unique_ptr<TPackedClusterStorage>> replicas(nodesCount);
+    std::vector<char> pinned(nodesCount, 0);
+    std::vector<std::thread> builders;
+    for (size_t node = 0; node < nodesCount; ++node) {
+        builders.emplace_back([&, node]() {
+            if (params.NumaReplicas) {
+                pinned[node] = PinThreadToNumaNode(node);
+            }
+            replicas[node] = TPackedClusterStorage::Make(*dict.Storage, params.HugePages);
+        });
+    }
+    for (std::thread& builder : builders) {
+        builder.join();
+    }
+
+    size_t totalBytes = 0;
+    size_t hugePageBytes = 0;
+    size_t pinnedCount = 0;
+    for (size_t node = 0; node < nodesCount; ++node) {
+        if (!replicas[node]) {
+            return false;
+        }
+        totalBytes += replicas[node]->GetMemory().GetSize();
+        hugePageBytes += std::min(replicas[node]->GetMemory().GetSize(), replicas[node]->GetMemory().GetHugePageBytes());
+        pinnedCount += pinned[node];
+    }
+    const bool explicitHugePages = replicas.front()->GetMemory().HasExplicitHugePages();
+
+    dict.Storage = std::move(replicas.front());
+    dict.NodeStorages.clear();
+    for (size_t node = 1; node < nodesCount; ++node) {
+        dict.NodeStorages.push_back(std::move(replicas[node]));
+    }
+
+    std::cerr << "placement: cluster storage only, " << nodesCount << " replica(s)";
+    if (params.NumaReplicas) {
+        std::cerr << ", " << pinnedCount << " of " << nodesCount << " placed on their NUMA node";
+    }
+    std::cerr << ", huge pages: " << (hugePageBytes >> 20) << " of " << (totalBytes >> 20) << " MB";
+    if (params.HugePages) {
+        std::cerr << (explicitHugePages ? " (explicit)" : " (transparent)");
+    }
+    std::cerr << std::endl;
+    return true;
+}
+
+bool PlaceModel(const TPlacementParams& params, TDictSet& dicts) {
+    for (const std::unique_ptr<TDict>& dict : dicts.Dicts) {
+        if (!PlaceModel(params, *dict)) {
+            return false;
+        }
+    }
+    // pool workers search dictionaries too, so they read the replicas of
+    // their own node as well
+    if (params.NumaReplicas && dicts.Pool) {
+        dicts.Pool.reset(new TThreadPool(dicts.Pool->GetThreadsCount(), GetNumaNodesCount()));
+    }
+    return true;
+}
+
+std::shared_ptr<TModelSnapshot> MakeModelSnapshot(
+    const TModelParams& modelParams,
+    const TCacheParams& cacheParams,
+    const TPlacementParams& placementParams,
+    const std::string& userWordsPath,
+    const std::wstring& layoutLine)
+{
+    std::shared_ptr<TModelSnapshot> snapshot(new TModelSnapshot());
+    if (!LoadDicts(modelParams, snapshot->Dicts) ||
+        !BuildModel(modelParams, layoutLine, snapshot->Layout, snapshot->Dicts) ||
+        (!userWordsPath.empty() && !LoadOverlay(userWordsPath, snapshot->Layout, snapshot->Overlay)) ||
+        !PlaceModel(placementParams, snapshot->Dicts))
+    {
+        return nullptr;
+    }
+    snapshot->Cache = cacheParams.MakeCache();
+    return snapshot;
+}
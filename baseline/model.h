@@ -0,0 +1,112 @@
+#pragma once
+
+#include "args.h"
+#include "dict.h"
+#include "dict_set.h"
+#include "result_cache.h"
+#include "swipe.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+struct TModelParams {
+    // comma-separated for several dictionaries decoded together
+    std::string DictPath;
+    // comma-separated scores added to candidates of each dictionary
+    std::string DictOffsets;
+
+    size_t ClustersCount = 1000;
+    size_t IterationsCount = 5;
+    size_t MaxClusterSize = 0;
+    // Lloyd iterations stop once a pass moves at most this share of words
+    double MaxChurn = 0.;
+    // clusters start from centers saved here by the previous build, if
+    // any, and the new centers are saved back
+    std::string CentersPath;
+
+    // 0 runs full Lloyd passes over the whole dict
+    size_t MiniBatchSize = 0;
+    size_t MiniBatchIterations = 100;
+
+    bool CollapseRepeatedKeys = false;
+
+    size_t EmbeddingLength = DefaultEmbeddingLength;
+    size_t ShortEmbeddingLength = DefaultShortEmbeddingLength;
+
+    std::string StoragePath;
+    // open StoragePath if it was built for the same words and layout,
+    // skipping clustering and the in-memory clusters it needs
+    bool ReuseStorage = false;
+
+    TClusterIndexParams Index;
+    std::string IndexPath;
+
+    size_t QuantizerSegments = 0;
+    size_t QuantizerSamples = 20000;
+    size_t QuantizerIterations = 8;
+
+    // linear model rescoring candidates, see TLinearReranker
+    std::string RerankerPath;
+
+    void AddHandlers(TArgsParser& argsParser);
+
+    std::vector<std::string> GetDictPaths() const;
+};
+
+struct TCacheParams {
+    size_t Size = 0;
+    double Grid = 0.25;
+
+    void AddHandlers(TArgsParser& argsParser);
+    std::unique_ptr<TResultCache> MakeCache() const;
+};
+
+struct TPlacementParams {
+    bool HugePages = false;
+    bool NumaReplicas = false;
+
+    void AddHandlers(TArgsParser& argsParser);
+};
+
+void AddSearchParamsHandlers(TArgsParser& argsParser, TSearchParams& searchParams);
+
+bool LoadDict(const std::string& dictPath, TDict& dict);
+// Loads every dictionary of params with its score offset and sets up the
+// pool decoding them in parallel.
+bool LoadDicts(const TModelParams& params, TDictSet& dicts);
+
+// Builds the overlay of personal words from a dictionary file; call after
+// the layout is loaded.
+bool LoadOverlay(const std::string& wordsPath, const TKeyboardLayout& layout, TDictOverlay& overlay);
+
+// Loads the layout from the first column of a tasks line and builds clusters,
+// cluster storage and the cluster index of dict for it.
+bool BuildModel(const TModelParams& params, const std::wstring& layoutLine, TKeyboardLayout& layout, TDict& dict);
+// Same for every dictionary of the set; storage, index and centers files of the
+// dictionary i > 0 get the suffix .i.
+bool BuildModel(const TModelParams& params, const std::wstring& layoutLine, TKeyboardLayout& layout, TDictSet& dicts);
+
+// Moves in-memory cluster storage of a built model to huge pages and/or
+// replicates it per NUMA node, reporting the placement achieved. Threads
+// read their node's replica once pinned with PinThreadToNumaNode.
+bool PlaceModel(const TPlacementParams& params, TDict& dict);
+bool PlaceModel(const TPlacementParams& params, TDictSet& dicts);
+
+// Everything a decoder reads, built together and replaced together.
+struct TModelSnapshot {
+    TKeyboardLayout Layout;
+    TDictSet Dicts;
+    TDictOverlay Overlay;
+    // cached results point into Dicts, so each snapshot has a cache of its own
+    std::unique_ptr<TResultCache> Cache;
+};
+
+// Loads the dictionaries and user words and builds a placed model for the
+// layout of layoutLine; nullptr on errors.
+std::shared_ptr<TModelSnapshot> MakeModelSnapshot(
+    const TModelParams& modelParams,
+    const TCacheParams& cacheParams,
+    const TPlacementParams& placementParams,
+    const std::string& userWordsPath,
+    const std::wstring& layoutLine);
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <cstddef>
+
+// Bounded lock-free queue connecting pipeline stages (D. Vyukov's MPMC ring):
+// every cell carries a sequence number telling producers and consumers
+// whether it is free or filled for the current lap. Push blocks while the
+// queue is full, which is what gives back-pressure to the upstream stage.
+// A blocked side spins briefly, then yields, then parks on a condition
+// variable; the other side takes the mutex only when someone is parked, so
+// an idle pipeline sleeps and a busy one stays lock-free.
+template <typename T>
+class TBoundedQueue {
+private:
+    struct TCell {
+        std::atomic<size_t> Sequence;
+        T Value;
+    };
+
+    enum {
+        CacheLineSize = 64,
+        SpinCount = 64,
+        YieldCount = 16
+    };
+
+    const size_t Mask;
+    std::unique_ptr<TCell[]> Cells;
+
+    alignas(CacheLineSize) std::atomic<size_t> EnqueuePos;
+    alignas(CacheLineSize) std::atomic<size_t> DequeuePos;
+    alignas(CacheLineSize) std::atomic<bool> Closed;
+
+    alignas(CacheLineSize) std::atomic<size_t> PushWaiters;
+    std::atomic<size_t> PopWaiters;
+    std::mutex Mutex;
+    std::condition_variable NotFull;
+    std::condition_variable NotEmpty;
+public:
+    // capacity is rounded up to a power of two
+    explicit TBoundedQueue(const size_t capacity)
+        : Mask(RoundUp(capacity) - 1)
+        , Cells(new TCell[Mask + 1])
+        , EnqueuePos(0)
+        , DequeuePos(0)
+        , Closed(false)
+        , PushWaiters(0)
+        , PopWaiters(0)
+    {
+        for (size_t i = 0; i <= Mask; ++i) {
+            Cells[i].Sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool TryPush(T& value) {
+        size_t pos = EnqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            TCell& cell = Cells[pos & Mask];
+            const size_t sequence = cell.Sequence.load(std::memory_order_acquire);
+            const ptrdiff_t diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (EnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.Value = std::move(value);
+                    cell.Sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = EnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool TryPop(T& value) {
+        size_t pos = DequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            TCell& cell = Cells[pos & Mask];
+            const size_t sequence = cell.Sequence.load(std::memory_order_acquire);
+            const ptrdiff_t diff = static_cast<ptrdiff_t>(sequence) - static_cast<ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (DequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.Value);
+                    cell.Sequence.store(pos + Mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = DequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void Push(T value) {
+        for (size_t attempt = 0; !TryPush(value); ++attempt) {
+            if (attempt < SpinCount) {
+                continue;
+            }
+            if (attempt < SpinCount + YieldCount) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(Mutex);
+            PushWaiters.fetch_add(1);
+            NotFull.wait(guard, [&]() {
+                return TryPush(value);
+            });
+            PushWaiters.fetch_sub(1);
+            break;
+        }
+        Wake(PopWaiters, NotEmpty);
+    }
+
+    // returns false once the queue is closed and drained
+    bool Pop(T& value) {
+        for (size_t attempt = 0; ; ++attempt) {
+            if (TryPop(value)) {
+                break;
+            }
+            if (Closed.load(std::memory_order_acquire)) {
+                if (!TryPop(value)) {
+                    return false;
+                }
+                break;
+            }
+            if (attempt < SpinCount) {
+                continue;
+            }
+            if (attempt < SpinCount + YieldCount) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(Mutex);
+            PopWaiters.fetch_add(1);
+            bool popped = false;
+            NotEmpty.wait(guard, [&]() {
+                popped = TryPop(value);
+                return popped || Closed.load(std::memory_order_acquire);
+            });
+            PopWaiters.fetch_sub(1);
+            if (!popped && !TryPop(value)) {
+                return false;
+            }
+            break;
+        }
+        Wake(PushWaiters, NotFull);
+        return true;
+    }
+
+    // no more pushes will follow; called by the last producer
+    void Close() {
+        Closed.store(true, std::memory_order_release);
+        std::lock_guard<std::mutex> guard(Mutex);
+        NotEmpty.notify_all();
+    }
+private:
+    // waiters are read with a read-modify-write: either it sees the
+    // increment of a thread about to park, or that thread's increment reads
+    // from it and the thread then sees the cell just published
+    void Wake(std::atomic<size_t>& waiters, std::condition_variable& condition) {
+        if (waiters.fetch_add(0)) {
+            std::lock_guard<std::mutex> guard(Mutex);
+            condition.notify_one();
+        }
+    }
+
+    static size_t RoundUp(const size_t capacity) {
+        size_t result = 2;
+        while (result < capacity) {
+            result *= 2;
+        }
+        return result;
+    }
+};
@@ -0,0 +1,151 @@
+#include "placement.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <cstdint>
+#include <cstdio>
+
+#include <sched.h>
+#include <sys/mman.h>
+
+namespace {
+    enum {
+        HugePageSize = 2 << 20
+    };
+
+    thread_local size_t ThreadNumaNode = 0;
+
+    const std::string NodesPath = "/sys/devices/system/node/";
+}
+
+TModelMemory::~TModelMemory() {
+    if (Mapped) {
+        munmap(Mapped, MappedSize);
+    }
+}
+
+bool TModelMemory::Allocate(const size_t size, const bool hugePages) {
+    Size = size;
+    if (!Size) {
+        return true;
+    }
+
+    if (hugePages) {
+        MappedSize = (Size + HugePageSize - 1) / HugePageSize * HugePageSize;
+        void* data = mmap(nullptr, MappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED) {
+            Mapped = Data = static_cast<char*>(data);
+            ExplicitHugePages = true;
+            return true;
+        }
+
+        // transparent huge pages only back 2 MB aligned ranges
+        MappedSize += HugePageSize;
+    } else {
+        MappedSize = Size;
+    }
+
+    void* data = mmap(nullptr, MappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        MappedSize = 0;
+        return false;
+    }
+    Mapped = static_cast<char*>(data);
+    Data = Mapped;
+
+    if (hugePages) {
+        const uintptr_t address = reinterpret_cast<uintptr_t>(Mapped);
+        Data = reinterpret_cast<char*>((address + HugePageSize - 1) / HugePageSize * HugePageSize);
+        madvise(Data, MappedSize - (Data - Mapped), MADV_HUGEPAGE);
+    }
+    return true;
+}
+
+size_t TModelMemory::GetHugePageBytes() const {
+    if (!Size) {
+        return 0;
+    }
+    if (ExplicitHugePages) {
+        return MappedSize;
+    }
+
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(Data);
+    const uintptr_t end = begin + Size;
+
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool inside = false;
+    size_t hugePageBytes = 0;
+    while (std::getline(smaps, line)) {
+        uintptr_t rangeBegin = 0;
+        uintptr_t rangeEnd = 0;
+        if (sscanf(line.c_str(), "%lx-%lx ", &rangeBegin, &rangeEnd) == 2 && line.find(':') > line.find(' ')) {
+            inside = rangeBegin < end && begin < rangeEnd;
+            continue;
+        }
+
+        size_t kilobytes = 0;
+        if (inside && sscanf(line.c_str(), "AnonHugePages: %zu kB", &kilobytes) == 1) {
+            hugePageBytes += kilobytes << 10;
+        }
+    }
+    return hugePageBytes;
+}
+
+size_t GetNumaNodesCount() {
+    size_t count = 0;
+    while (std::ifstream(NodesPath + "node" + std::to_string(count) + "/cpulist")) {
+        ++count;
+    }
+    return std::max<size_t>(count, 1);
+}
+
+std::vector<int> GetNumaNodeCpus(const size_t node) {
+    std::ifstream in(NodesPath + "node" + std::to_string(node) + "/cpulist");
+    std::string cpuList;
+    std::getline(in, cpuList);
+
+    // ranges like "0-3,8-11"
+    std::vector<int> cpus;
+    std::stringstream ranges(cpuList);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        int first = 0;
+        int last = 0;
+        const int parsed = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (parsed < 1) {
+            continue;
+        }
+        if (parsed == 1) {
+            last = first;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+bool PinThreadToNumaNode(const size_t node) {
+    const std::vector<int> cpus = GetNumaNodeCpus(node);
+    if (cpus.empty()) {
+        return false;
+    }
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (const int cpu : cpus) {
+        CPU_SET(cpu, &cpuSet);
+    }
+    if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) != 0) {
+        return false;
+    }
+    ThreadNumaNode = node;
+    return true;
+}
+
+size_t GetThreadNumaNode() {
+    return ThreadNumaNode;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+
+// Anonymous memory for read-only model arrays. With huge pages it first
+// asks for explicit 2 MB pages and falls back to transparent huge pages;
+// GetHugePageBytes tells what the kernel actually gave.
+class TModelMemory {
+private:
+    char* Data = nullptr;
+    size_t Size = 0;
+    size_t MappedSize = 0;
+    char* Mapped = nullptr;
+    bool ExplicitHugePages = false;
+public:
+    TModelMemory() = default;
+    TModelMemory(const TModelMemory&) = delete;
+    TModelMemory& operator = (const TModelMemory&) = delete;
+    ~TModelMemory();
+
+    bool Allocate(const size_t size, const bool hugePages);
+
+    char* GetData() const {
+        return Data;
+    }
+
+    size_t GetSize() const {
+        return Size;
+    }
+
+    bool HasExplicitHugePages() const {
+        return ExplicitHugePages;
+    }
+
+    size_t GetHugePageBytes() const;
+};
+
+// NUMA nodes as seen in /sys, a single node where that is not available
+size_t GetNumaNodesCount();
+std::vector<int> GetNumaNodeCpus(const size_t node);
+
+// Pins the calling thread to the cpus of the node and, once that worked,
+// remembers the node, so that the thread reads model replicas local to it.
+bool PinThreadToNumaNode(const size_t node);
+size_t GetThreadNumaNode();
@@ -0,0 +1,116 @@
+#include "pq.h"
+
+#include <limits>
+
+static double SegmentSquaredDistance(const TCoord* lhs, const TCoord* rhs, const size_t length) {
+    double distance = 0.;
+    for (size_t i = 0; i < length; ++i) {
+        const double xDiff = lhs[i].X - rhs[i].X;
+        const double yDiff = lhs[i].Y - rhs[i].Y;
+        distance += xDiff * xDiff + yDiff * yDiff;
+    }
+    return distance;
+}
+
+bool TProductQuantizer::Train(
+    const std::vector<TCoord>& samples,
+    const size_t samplesCount,
+    const size_t length,
+    const size_t segmentsCount,
+    const size_t iterationsCount,
+    std::mt19937_64& random)
+{
+    Length = length;
+    SegmentsCount = std::min(segmentsCount, length);
+    if (!samplesCount || !SegmentsCount) {
+        SegmentsCount = 0;
+        SegmentStarts.clear();
+        Codebooks.clear();
+        return false;
+    }
+
+    SegmentStarts.clear();
+    for (size_t m = 0; m <= SegmentsCount; ++m) {
+        SegmentStarts.push_back(m * Length / SegmentsCount);
+    }
+
+    Codebooks.assign(SegmentsCount, {});
+
+    std::vector<size_t> assignment(samplesCount);
+    for (size_t m = 0; m < SegmentsCount; ++m) {
+        const size_t segmentStart = SegmentStarts[m];
+        const size_t segmentLength = GetSegmentLength(m);
+        std::vector<TCoord>& codebook = Codebooks[m];
+
+        codebook.resize(CentroidsCount * segmentLength);
+        for (size_t c = 0; c < CentroidsCount; ++c) {
+            const TCoord* sample = samples.data() + (random() % samplesCount) * Length + segmentStart;
+            std::copy(sample, sample + segmentLength, codebook.begin() + c * segmentLength);
+        }
+
+        for (size_t iteration = 0; iteration < iterationsCount; ++iteration) {
+            for (size_t i = 0; i < samplesCount; ++i) {
+                assignment[i] = FindNearestCentroid(m, samples.data() + i * Length + segmentStart);
+            }
+
+            std::vector<TCoord> sums(CentroidsCount * segmentLength);
+            std::vector<size_t> counts(CentroidsCount);
+            for (size_t i = 0; i < samplesCount; ++i) {
+                const TCoord* sample = samples.data() + i * Length + segmentStart;
+                TCoord* sum = sums.data() + assignment[i] * segmentLength;
+                for (size_t j = 0; j < segmentLength; ++j) {
+                    sum[j].X += sample[j].X;
+                    sum[j].Y += sample[j].Y;
+                }
+                ++counts[assignment[i]];
+            }
+
+            for (size_t c = 0; c < CentroidsCount; ++c) {
+                TCoord* centroid = codebook.data() + c * segmentLength;
+                if (!counts[c]) {
+                    const TCoord* sample = samples.data() + (random() % samplesCount) * Length + segmentStart;
+                    std::copy(sample, sample + segmentLength, centroid);
+                    continue;
+                }
+                for (size_t j = 0; j < segmentLength; ++j) {
+                    centroid[j].X = sums[c * segmentLength + j].X / counts[c];
+                    centroid[j].Y = sums[c * segmentLength + j].Y / counts[c];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void TProductQuantizer::Encode(const TCoord* embedding, unsigned char* code) const {
+    for (size_t m = 0; m < SegmentsCount; ++m) {
+        code[m] = FindNearestCentroid(m, embedding + SegmentStarts[m]);
+    }
+}
+
+void TProductQuantizer::BuildLookupTable(const TCoord* query, std::vector<float>& table) const {
+    table.resize(SegmentsCount * CentroidsCount);
+    for (size_t m = 0; m < SegmentsCount; ++m) {
+        const size_t segmentLength = GetSegmentLength(m);
+        const TCoord* segment = query + SegmentStarts[m];
+        for (size_t c = 0; c < CentroidsCount; ++c) {
+            table[m * CentroidsCount + c] = SegmentSquaredDistance(segment, Codebooks[m].data() + c * segmentLength, segmentLength);
+        }
+    }
+}
+
+size_t TProductQuantizer::FindNearestCentroid(const size_t segment, const TCoord* points) const {
+    const size_t segmentLength = GetSegmentLength(segment);
+    const std::vector<TCoord>& codebook = Codebooks[segment];
+
+    size_t best = 0;
+    double bestDistance = std::numeric_limits<double>::max();
+    for (size_t c = 0; c < CentroidsCount; ++c) {
+        const double distance = SegmentSquaredDistance(points, codebook.data() + c * segmentLength, segmentLength);
+        if (distance < bestDistance) {
+            bestDistance = distance;
+            best = c;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "embedding.h"
+
+#include <random>
+#include <vector>
+
+// Product quantizer for full-length embeddings: the points are split into
+// SegmentsCount consecutive segments and every segment is replaced by the
+// id of its nearest centroid in a per-segment codebook, one byte each.
+// Squared distance from a query to a coded embedding is then approximated
+// by summing SegmentsCount entries of a per-query lookup table (ADC).
+class TProductQuantizer {
+public:
+    enum {
+        CentroidsCount = 256
+    };
+private:
+    size_t Length = 0;
+    size_t SegmentsCount = 0;
+    std::vector<size_t> SegmentStarts;
+    // codebook of segment m holds CentroidsCount centroids of its length
+    std::vector<std::vector<TCoord>> Codebooks;
+public:
+    // samples holds samplesCount embeddings of the given length back to
+    // back; false, with nothing to encode against, if there are no samples
+    bool Train(
+        const std::vector<TCoord>& samples,
+        const size_t samplesCount,
+        const size_t length,
+        const size_t segmentsCount,
+        const size_t iterationsCount,
+        std::mt19937_64& random);
+
+    size_t GetSegmentsCount() const {
+        return SegmentsCount;
+    }
+
+    void Encode(const TCoord* embedding, unsigned char* code) const;
+
+    // table[m * CentroidsCount + c] is the squared distance between segment
+    // m of the query and centroid c of its codebook
+    void BuildLookupTable(const TCoord* query, std::vector<float>& table) const;
+
+    float Distance(const unsigned char* code, const float* table) const {
+        float distance = 0.f;
+        for (size_t m = 0; m < SegmentsCount; ++m, table += CentroidsCount) {
+            distance += table[code[m]];
+        }
+        return distance;
+    }
+private:
+    size_t GetSegmentLength(const size_t segment) const {
+        return SegmentStarts[segment + 1] - SegmentStarts[segment];
+    }
+
+    size_t FindNearestCentroid(const size_t segment, const TCoord* points) const;
+};
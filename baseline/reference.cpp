@@ -0,0 +1,152 @@
+#include "reference.h"
+
+#include "string_pool.h"
+
+#include <algorithm>
+
+namespace {
+    // centers of the keys of the word letter by letter, straight from the
+    // parsed layout: no key ids, key tables or encoded word keys
+    std::vector<TCoord> GetLetterCenters(const TKeyboardLayout& layout, const std::string_view word) {
+        std::vector<TCoord> centers;
+        for (const wchar_t symbol : DecodeUtf8(word)) {
+            const auto it = layout.KeyInfos.find(symbol);
+            if (it != layout.KeyInfos.end()) {
+                centers.push_back(it->second.Center());
+            }
+        }
+        return centers;
+    }
+}
+
+TReferenceDecoder::TReferenceDecoder(const TKeyboardLayout& layout, const TDict& dict)
+    : Layout(layout)
+    , Dict(dict)
+    , WordEmbeddings(dict.Words.GetSize())
+{
+    for (TDict::TWordIndex wordIdx = 0; wordIdx < dict.Words.GetSize(); ++wordIdx) {
+        WordEmbeddings[wordIdx] = MakeWordPoints(dict.Words[wordIdx]);
+    }
+}
+
+std::vector<TCoord> TReferenceDecoder::MakeWordPoints(const std::string_view word) const {
+    const std::vector<TCoord> centers = GetLetterCenters(Layout, word);
+    if (centers.empty()) {
+        return centers;
+    }
+    return TKeyboardLayout::ProducePoints(centers, Layout.Kernels->Length);
+}
+
+double TReferenceDecoder::Score(const std::vector<TCoord>& lhs, const std::vector<TCoord>& rhs) {
+    double sumSquaredDistances = 0.;
+    for (size_t i = 0; i < lhs.size() && i < rhs.size(); ++i) {
+        const double xDiff = lhs[i].X - rhs[i].X;
+        const double yDiff = lhs[i].Y - rhs[i].Y;
+        sumSquaredDistances += xDiff * xDiff + yDiff * yDiff;
+    }
+    return -sumSquaredDistances;
+}
+
+std::vector<TCoord> TReferenceDecoder::Shorten(const std::vector<TCoord>& embedding, const size_t shortLength) {
+    std::vector<TCoord> shortEmbedding(shortLength);
+    for (size_t i = 0; i < shortLength; ++i) {
+        const size_t start = i * embedding.size() / shortLength;
+        const size_t end = (i + 1) * embedding.size() / shortLength;
+        for (size_t j = start; j < end; ++j) {
+            shortEmbedding[i].X += embedding[j].X;
+            shortEmbedding[i].Y += embedding[j].Y;
+        }
+        if (end > start) {
+            shortEmbedding[i].X /= end - start;
+            shortEmbedding[i].Y /= end - start;
+        }
+    }
+    return shortEmbedding;
+}
+
+double TReferenceDecoder::ScoreWord(const std::string_view word, const std::vector<TCoord>& points) const {
+    const std::vector<TCoord> wordPoints = MakeWordPoints(word);
+    if (wordPoints.empty()) {
+        return 0.;
+    }
+    return Score(wordPoints, points);
+}
+
+std::vector<std::pair<double, std::string_view>> TReferenceDecoder::GetCandidates(const std::vector<TCoord>& points, const size_t topSize) const {
+    std::vector<std::pair<double, std::string_view>> candidates;
+    for (TDict::TWordIndex wordIdx = 0; wordIdx < WordEmbeddings.size(); ++wordIdx) {
+        if (!Dict.IsRemoved(wordIdx) && !WordEmbeddings[wordIdx].empty()) {
+            candidates.push_back(std::make_pair(Score(WordEmbeddings[wordIdx], points), Dict.Words[wordIdx]));
+        }
+    }
+
+    std::stable_sort(candidates.begin(), candidates.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first > rhs.first;
+    });
+    if (candidates.size() > topSize) {
+        candidates.resize(topSize);
+    }
+    return candidates;
+}
+
+std::vector<size_t> TReferenceDecoder::FindClusters(const std::vector<TCoord>& points, const size_t limit) const {
+    const std::vector<TCoord> shortEmbedding = Shorten(points, Dict.Kernels->ShortLength);
+
+    std::vector<std::pair<double, size_t>> distances;
+    for (const TShortEmbedding& cluster : Dict.ClusterEmbeddings) {
+        distances.push_back(std::make_pair(-Score(cluster.Coords, shortEmbedding), cluster.Idx));
+    }
+    std::sort(distances.begin(), distances.end());
+
+    std::vector<size_t> clusters;
+    for (size_t i = 0; i < distances.size() && i < limit; ++i) {
+        clusters.push_back(distances[i].second);
+    }
+    return clusters;
+}
+
+std::vector<TSwipeEvent> MakeSyntheticSwipes(
+    const TKeyboardLayout& layout,
+    const TDict& dict,
+    const size_t count,
+    const double noise,
+    std::mt19937_64& random)
+{
+    enum {
+        StepsBetweenKeys = 4
+    };
+
+    std::vector<TSwipeEvent> swipeEvents;
+    if (!dict.Words.GetSize()) {
+        return swipeEvents;
+    }
+
+    std::normal_distribution<double> jitter(0., noise * layout.KeyWidth());
+    for (size_t attempt = 0; swipeEvents.size() < count && attempt < 10 * count; ++attempt) {
+        const TDict::TWordIndex wordIdx = random() % dict.Words.GetSize();
+        if (dict.IsRemoved(wordIdx)) {
+            continue;
+        }
+
+        const std::vector<TCoord> keyCenters = GetLetterCenters(layout, dict.Words[wordIdx]);
+        if (keyCenters.empty()) {
+            continue;
+        }
+
+        TSwipeEvent swipeEvent;
+        swipeEvent.Target = DecodeUtf8(dict.Words[wordIdx]);
+        for (size_t i = 0; i < keyCenters.size(); ++i) {
+            const size_t steps = i + 1 < keyCenters.size() ? StepsBetweenKeys : 1;
+            for (size_t step = 0; step < steps; ++step) {
+                const TCoord& from = keyCenters[i];
+                const TCoord& to = i + 1 < keyCenters.size() ? keyCenters[i + 1] : keyCenters[i];
+                const double part = static_cast<double>(step) / steps;
+                swipeEvent.Points.push_back(TCoord(
+                    from.X + (to.X - from.X) * part + jitter(random),
+                    from.Y + (to.Y - from.Y) * part + jitter(random)));
+            }
+        }
+        swipeEvents.push_back(swipeEvent);
+    }
+    return swipeEvents;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "dict.h"
+#include "swipe.h"
+
+#include <random>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Straightforward decoder the optimized paths are checked against: no
+// clusters, no index, no quantization and no fixed-length kernels, every
+// live word of the dict is scored for every swipe with plain loops. Word
+// points are built from the word text letter by letter, not from the
+// encoded word keys and key tables the optimized decoder uses.
+class TReferenceDecoder {
+private:
+    const TKeyboardLayout& Layout;
+    const TDict& Dict;
+
+    std::vector<std::vector<TCoord>> WordEmbeddings;
+
+    std::vector<TCoord> MakeWordPoints(const std::string_view word) const;
+public:
+    TReferenceDecoder(const TKeyboardLayout& layout, const TDict& dict);
+
+    static double Score(const std::vector<TCoord>& lhs, const std::vector<TCoord>& rhs);
+    static std::vector<TCoord> Shorten(const std::vector<TCoord>& embedding, const size_t shortLength);
+
+    // scores any word, in the dict or not
+    double ScoreWord(const std::string_view word, const std::vector<TCoord>& points) const;
+
+    // best words first, equal scores in dict order
+    std::vector<std::pair<double, std::string_view>> GetCandidates(const std::vector<TCoord>& points, const size_t topSize) const;
+
+    // ids of the limit clusters nearest to the swipe by a full scan of the centers
+    std::vector<size_t> FindClusters(const std::vector<TCoord>& points, const size_t limit) const;
+};
+
+// Swipes through the keys of random live dict words: every key center and
+// a few points on the way to the next key, all jittered by gaussian noise
+// with the deviation of noise key widths. Targets are the words.
+std::vector<TSwipeEvent> MakeSyntheticSwipes(
+    const TKeyboardLayout& layout,
+    const TDict& dict,
+    const size_t count,
+    const double noise,
+    std::mt19937_64& random);
@@ -0,0 +1,103 @@
+#include "result_cache.h"
+
+#include <algorithm>
+#include <cmath>
+
+size_t TResultCache::TKeyHash::operator () (const TKey& key) const {
+    uint64_t hash = key.LayoutId ^ 0x9e3779b97f4a7c15ULL;
+    for (const int cell : key.Cells) {
+        hash ^= static_cast<uint32_t>(cell);
+        hash *= 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+TResultCache::TResultCache(const size_t capacity, const double gridFraction, const size_t shardsCount /*= 16*/)
+    : ShardCapacity(std::max<size_t>(1, (capacity + shardsCount - 1) / shardsCount))
+    , GridFraction(gridFraction)
+    , Hits(0)
+    , Misses(0)
+{
+    for (size_t i = 0; i < shardsCount; ++i) {
+        Shards.emplace_back(new TShard());
+    }
+}
+
+TResultCache::TKey TResultCache::MakeKey(const uint64_t layoutId, const double keyWidth, const std::vector<TCoord>& shortEmbedding) const {
+    const double step = std::max(1e-5, GridFraction * keyWidth);
+
+    TKey key;
+    key.LayoutId = layoutId;
+    key.Cells.reserve(shortEmbedding.size() * 2);
+    for (const TCoord& coord : shortEmbedding) {
+        key.Cells.push_back(static_cast<int>(std::floor(coord.X / step)));
+        key.Cells.push_back(static_cast<int>(std::floor(coord.Y / step)));
+    }
+    return key;
+}
+
+bool TResultCache::Find(const TKey& key, TResult& result) {
+    TShard& shard = GetShard(key);
+    {
+        std::lock_guard<std::mutex> guard(shard.Mutex);
+        auto it = shard.Index.find(key);
+        if (it != shard.Index.end()) {
+            shard.Entries.splice(shard.Entries.begin(), shard.Entries, it->second);
+            result = it->second->second;
+            ++Hits;
+            return true;
+        }
+    }
+    ++Misses;
+    return false;
+}
+
+void TResultCache::Insert(const TKey& key, const TResult& result) {
+    TShard& shard = GetShard(key);
+    std::lock_guard<std::mutex> guard(shard.Mutex);
+
+    auto it = shard.Index.find(key);
+    if (it != shard.Index.end()) {
+        it->second->second = result;
+        shard.Entries.splice(shard.Entries.begin(), shard.Entries, it->second);
+        return;
+    }
+
+    shard.Entries.emplace_front(key, result);
+    shard.Index[key] = shard.Entries.begin();
+
+    if (shard.Entries.size() > ShardCapacity) {
+        shard.Index.erase(shard.Entries.back().first);
+        shard.Entries.pop_back();
+    }
+}
+
+void TResultCache::Clear() {
+    for (std::unique_ptr<TShard>& shard : Shards) {
+        std::lock_guard<std::mutex> guard(shard->Mutex);
+        shard->Index.clear();
+        shard->Entries.clear();
+    }
+}
+
+size_t TResultCache::GetHits() const {
+    return Hits;
+}
+
+size_t TResultCache::GetMisses() const {
+    return Misses;
+}
+
+size_t TResultCache::GetSize() const {
+    size_t size = 0;
+    for (const std::unique_ptr<TShard>& shard : Shards) {
+        std::lock_guard<std::mutex> guard(shard->Mutex);
+        size += shard->Entries.size();
+    }
+    return size;
+}
+
+TResultCache::TShard& TResultCache::GetShard(const TKey& key) {
+    return *Shards[TKeyHash()(key) % Shards.size()];
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "embedding.h"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+// Bounded thread-safe LRU cache of decoder results. Swipes are keyed by their
+// short embedding snapped to a grid of GridFraction key widths, so repeated
+// and near-identical swipes of the same word on the same layout share an
+// entry. One cache serves one dictionary with fixed search params.
+class TResultCache {
+public:
+    using TResult = std::vector<std::pair<double, std::string_view>>;
+
+    struct TKey {
+        uint64_t LayoutId = 0;
+        std::vector<int> Cells;
+
+        bool operator == (const TKey& other) const {
+            return LayoutId == other.LayoutId && Cells == other.Cells;
+        }
+    };
+
+    struct TKeyHash {
+        size_t operator () (const TKey& key) const;
+    };
+private:
+    using TEntries = std::list<std::pair<TKey, TResult>>;
+
+    struct TShard {
+        std::mutex Mutex;
+        TEntries Entries;
+        std::unordered_map<TKey, TEntries::iterator, TKeyHash> Index;
+    };
+
+    size_t ShardCapacity;
+    double GridFraction;
+    std::vector<std::unique_ptr<TShard>> Shards;
+
+    std::atomic<size_t> Hits;
+    std::atomic<size_t> Misses;
+public:
+    TResultCache(const size_t capacity, const double gridFraction, const size_t shardsCount = 16);
+
+    TKey MakeKey(const uint64_t layoutId, const double keyWidth, const std::vector<TCoord>& shortEmbedding) const;
+
+    bool Find(const TKey& key, TResult& result);
+    void Insert(const TKey& key, const TResult& result);
+    void Clear();
+
+    size_t GetHits() const;
+    size_t GetMisses() const;
+    size_t GetSize() const;
+private:
+    TShard& GetShard(const TKey& key);
+};
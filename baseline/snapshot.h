@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <cstdint>
+
+// Atomically swappable reference-counted snapshot. Readers never block
+// while there are free slots: Get announces the current epoch in a free
+// slot, copies the shared_ptr out of the current box and leaves, so the
+// snapshot lives as long as the reader's copy. Readers finding all slots
+// taken copy under the writer lock instead. Publish swaps in a new box and deletes the old one once all
+// readers announced in earlier epochs have left; the old snapshot goes away
+// with its last reader.
+template <typename T>
+class TSnapshotHolder {
+private:
+    enum {
+        SlotsCount = 64,
+        CacheLineSize = 64
+    };
+
+    struct alignas(CacheLineSize) TSlot {
+        std::atomic<uint64_t> Epoch;
+    };
+
+    using TBox = std::shared_ptr<T>;
+
+    std::atomic<TBox*> Current;
+    std::atomic<uint64_t> GlobalEpoch;
+    TSlot Slots[SlotsCount];
+
+    std::mutex WriterMutex;
+public:
+    explicit TSnapshotHolder(std::shared_ptr<T> snapshot = nullptr)
+        : Current(new TBox(std::move(snapshot)))
+        , GlobalEpoch(1)
+    {
+        for (TSlot& slot : Slots) {
+            slot.Epoch.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    ~TSnapshotHolder() {
+        delete Current.load();
+    }
+
+    std::shared_ptr<T> Get() {
+        static thread_local const size_t slotHint = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+        TSlot* slot = nullptr;
+        for (size_t i = 0; i < SlotsCount && !slot; ++i) {
+            TSlot& candidate = Slots[(slotHint + i) % SlotsCount];
+            uint64_t free = 0;
+            if (candidate.Epoch.compare_exchange_strong(free, GlobalEpoch.load())) {
+                slot = &candidate;
+            }
+        }
+        if (!slot) {
+            // more readers than slots: copy under the writer lock, the box
+            // is only deleted while it is held
+            std::lock_guard<std::mutex> guard(WriterMutex);
+            return *Current.load();
+        }
+
+        std::shared_ptr<T> snapshot = *Current.load();
+        slot->Epoch.store(0, std::memory_order_release);
+        return snapshot;
+    }
+
+    // returns once the old box is gone, the old snapshot itself lives on
+    // in the copies readers still hold
+    void Publish(std::shared_ptr<T> snapshot) {
+        std::lock_guard<std::mutex> guard(WriterMutex);
+
+        TBox* old = Current.exchange(new TBox(std::move(snapshot)));
+        const uint64_t retiredEpoch = GlobalEpoch.fetch_add(1) + 1;
+
+        // readers announced before the swap may still be copying from the
+        // old box, they only stay for a pointer copy
+        for (const TSlot& slot : Slots) {
+            for (uint64_t epoch = slot.Epoch.load(); epoch && epoch < retiredEpoch; epoch = slot.Epoch.load()) {
+                std::this_thread::yield();
+            }
+        }
+        delete old;
+    }
+};
@@ -0,0 +1,73 @@
+#include "string_pool.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+size_t TStringPool::Add(const std::string_view text) {
+    if (ChunkUsed + text.size() > ChunkSize) {
+        Chunks.emplace_back(new char[std::max<size_t>(ChunkSize, text.size())]);
+        ChunkUsed = 0;
+    }
+
+    char* data = Chunks.back().get() + ChunkUsed;
+    memcpy(data, text.data(), text.size());
+    ChunkUsed += text.size();
+    DataSize += text.size();
+
+    Strings.emplace_back(data, text.size());
+    return Strings.size() - 1;
+}
+
+std::wstring DecodeUtf8(const std::string_view text) {
+    std::wstring result;
+    result.reserve(text.size());
+    for (size_t i = 0; i < text.size();) {
+        const unsigned char lead = text[i];
+        size_t length = 1;
+        wchar_t symbol = lead;
+        if (lead >= 0xF0) {
+            length = 4;
+            symbol = lead & 0x07;
+        } else if (lead >= 0xE0) {
+            length = 3;
+            symbol = lead & 0x0F;
+        } else if (lead >= 0xC0) {
+            length = 2;
+            symbol = lead & 0x1F;
+        }
+        if (i + length > text.size()) {
+            break;
+        }
+        for (size_t j = 1; j < length; ++j) {
+            symbol = (symbol << 6) | (text[i + j] & 0x3F);
+        }
+        result += symbol;
+        i += length;
+    }
+    return result;
+}
+
+std::string EncodeUtf8(const std::wstring& text) {
+    std::string result;
+    result.reserve(text.size() * 2);
+    for (const wchar_t wideSymbol : text) {
+        const unsigned int symbol = wideSymbol;
+        if (symbol < 0x80) {
+            result += static_cast<char>(symbol);
+        } else if (symbol < 0x800) {
+            result += static_cast<char>(0xC0 | (symbol >> 6));
+            result += static_cast<char>(0x80 | (symbol & 0x3F));
+        } else if (symbol < 0x10000) {
+            result += static_cast<char>(0xE0 | (symbol >> 12));
+            result += static_cast<char>(0x80 | ((symbol >> 6) & 0x3F));
+            result += static_cast<char>(0x80 | (symbol & 0x3F));
+        } else {
+            result += static_cast<char>(0xF0 | (symbol >> 18));
+            result += static_cast<char>(0x80 | ((symbol >> 12) & 0x3F));
+            result += static_cast<char>(0x80 | ((symbol >> 6) & 0x3F));
+            result += static_cast<char>(0x80 | (symbol & 0x3F));
+        }
+    }
+    return result;
+}
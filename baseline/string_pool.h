@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Append-only pool of UTF-8 strings. Bytes live in large chunks that are
+// never moved, so views handed out stay valid for the lifetime of the pool
+// even while more strings are added.
+class TStringPool {
+private:
+    enum {
+        ChunkSize = 1 << 16
+    };
+
+    std::vector<std::unique_ptr<char[]>> Chunks;
+    size_t ChunkUsed = ChunkSize;
+    size_t DataSize = 0;
+
+    std::vector<std::string_view> Strings;
+public:
+    using TConstIterator = std::vector<std::string_view>::const_iterator;
+
+    size_t Add(const std::string_view text);
+
+    std::string_view operator [] (const size_t idx) const {
+        return Strings[idx];
+    }
+
+    size_t GetSize() const {
+        return Strings.size();
+    }
+
+    // bytes taken by the strings themselves, the view table aside
+    size_t GetDataSize() const {
+        return DataSize;
+    }
+
+    TConstIterator begin() const {
+        return Strings.begin();
+    }
+
+    TConstIterator end() const {
+        return Strings.end();
+    }
+};
+
+std::wstring DecodeUtf8(const std::string_view text);
+std::string EncodeUtf8(const std::wstring& text);
@@ -1,12 +1,16 @@
 #pragma once
 
 #include "dict.h"
+#include "result_cache.h"
 
 #include <string>
+#include <string_view>
 
 #include <unordered_map>
 #include <numeric>
 #include <functional>
+#include <iterator>
+#include <limits>
 
 #include <fstream>
 
@@ -75,18 +79,55 @@ struct TSwipeEvent {
     }
 };
 
+struct TSearchParams {
+    // clusters fetched from the index and then probed nearest first
+    size_t ClustersLimit = 20;
+    // stop probing once this many words have been scored, 0 means no limit;
+    // the nearest cluster is always scored in full
+    size_t WordsBudget = 0;
+    // clusters ahead of the current one to prefetch from cluster storage
+    size_t PrefetchClusters = 2;
+    // number of candidates returned
+    size_t TopSize = 10;
+    // if the dict has a quantizer, candidates are ranked by quantized
+    // distance and only this many best are scored exactly; 0 scores all
+    size_t RescoreCount = 0;
+    // keys whose rectangles are within this many key widths of some swipe
+    // point count as reachable; words needing more than KeyFilterMisses
+    // unreachable keys are skipped without scoring. 0 disables the filter,
+    // as do layouts with more keys than a TKeyMask has bits
+    double KeyFilterRadius = 0.;
+    size_t KeyFilterMisses = 0;
+    // with a reranker, this many best candidates of each dict are rescored
+    // by it before TopSize are kept; 0 reranks TopSize candidates
+    size_t RerankCount = 0;
+};
+
 struct TKeyboardLayout {
-private:
-    enum {
-        EmbeddingLength = 50
-    };
-public:
+    const TEmbeddingKernels* Kernels = DefaultEmbeddingKernels();
+
+    uint64_t Id = 0;
     std::vector<wchar_t> Keys;
-    std::vector<TShortEmbedding> ClusterEmbeddings;
+    TClusterIndexParams IndexParams;
+    // a key repeated in a row adds a zero-length segment only, words that
+    // differ in such repeats get one key path
+    bool CollapseRepeatedKeys = false;
 
     using TKeyInfosMap = std::unordered_map<wchar_t, TKeyInfo>;
     TKeyInfosMap KeyInfos;
 
+    // dense per-layout tables built by BuildKeyTables: key id by symbol,
+    // key centers by key id, squared key-to-key center distances and the
+    // mean key width
+    static constexpr TKeyId InvalidKeyId = 255;
+    // key ids a TKeyMask has bits for
+    static constexpr size_t MaskedKeysCount = 8 * sizeof(TKeyMask);
+    std::vector<TKeyId> KeyIdsBySymbol;
+    std::vector<TCoord> KeyCenters;
+    std::vector<double> KeyDistances;
+    std::vector<TKeyInfo> KeyRects;
+    double MeanKeyWidth = 0.;
+
     static std::vector<TCoord> ProducePoints(const std::vector<TCoord>& source, size_t neededPointsCount) {
         if (source.size() == 1) {
             return std::vector<TCoord>(neededPointsCount, source.front());
@@ -131,47 +172,326 @@ public:
         return modifiedPoints;
     }
 
-    std::vector<std::pair<double, std::wstring>> GetCandidates(const TSwipeEvent& swipeEvent, const TDict& dict, const size_t clustersLimit) const {
+    // The cache only ever holds results of the shared dict, overlay words
+    // are merged in afterwards, so one cache serves all users.
+    std::vector<std::pair<double, std::string_view>> GetCandidates(
+        const TSwipeEvent& swipeEvent,
+        const TDict& dict,
+        const TSearchParams& params,
+        TResultCache* cache = nullptr,
+        const TDictOverlay* overlay = nullptr) const
+    {
         const std::vector<TCoord> points = MakePoints(swipeEvent);
 
         TShortEmbedding shortEmbedding;
         shortEmbedding.Coords = dict.ShortenEmbedding(points);
 
-        double distanceLimit = 10000;
+        std::vector<std::pair<double, std::string_view>> candidates;
+        if (!cache) {
+            candidates = GetCandidates(points, shortEmbedding, dict, params);
+        } else {
+            const TResultCache::TKey key = cache->MakeKey(Id, KeyWidth(), shortEmbedding.Coords);
+            if (!cache->Find(key, candidates)) {
+                candidates = GetCandidates(points, shortEmbedding, dict, params);
+                cache->Insert(key, candidates);
+            }
+        }
+
+        if (overlay) {
+            MergeCandidates(candidates, ScoreOverlay(points, *overlay, params), params.TopSize);
+        }
+        return candidates;
+    }
+
+    bool AddWord(TDictOverlay& overlay, const std::string_view word) const {
+        const std::vector<TKeyId> keys = EncodeWord(word);
+        if (keys.empty()) {
+            return false;
+        }
+
+        TKeyPath path;
+        path.Keys = keys.data();
+        path.Size = keys.size();
+        const std::vector<TCoord> embedding = MakePoints(path);
+
+        overlay.Words.Add(word);
+        overlay.Embeddings.insert(overlay.Embeddings.end(), embedding.begin(), embedding.end());
+        return true;
+    }
+
+    std::vector<std::pair<double, std::string_view>> ScoreOverlay(const std::vector<TCoord>& points, const TDictOverlay& overlay, const TSearchParams& params) const {
+        std::vector<std::pair<double, std::string_view>> candidates;
+        for (size_t i = 0; i < overlay.Words.GetSize(); ++i) {
+            const double score = Kernels->Score(overlay.Embeddings.data() + i * Kernels->Length, points.data());
+            candidates.push_back(std::make_pair(score, overlay.Words[i]));
+        }
+        std::sort(candidates.begin(), candidates.end(), std::greater<>());
+        KeepTopCandidates(candidates, params.TopSize);
+        return candidates;
+    }
+
+    // Merges two lists sorted by score only, ties keep no particular word
+    // order; a word found in both keeps its better score.
+    static void MergeCandidates(
+        std::vector<std::pair<double, std::string_view>>& candidates,
+        const std::vector<std::pair<double, std::string_view>>& other,
+        const size_t topSize)
+    {
+        if (other.empty()) {
+            return;
+        }
 
-        std::vector<TShortEmbedding*> found = dict.ClustersVPTree->FindNearbyItems(shortEmbedding, distanceLimit, clustersLimit);
+        std::vector<std::pair<double, std::string_view>> merged;
+        merged.reserve(candidates.size() + other.size());
+        std::merge(candidates.begin(), candidates.end(), other.begin(), other.end(), std::back_inserter(merged), [](const auto& lhs, const auto& rhs) {
+            return lhs.first > rhs.first;
+        });
+        KeepTopCandidates(merged, topSize);
+        candidates.swap(merged);
+    }
 
-        while (found.empty() || found.size() == clustersLimit) {
-            while (found.empty()) {
-                found.clear();
-                distanceLimit *= 2;
-                found = dict.ClustersVPTree->FindNearbyItems(shortEmbedding, distanceLimit, clustersLimit);
+    // Drops repeated words of a list sorted by score, so the first, best
+    // scored copy stays, and cuts the list to topSize.
+    static void KeepTopCandidates(std::vector<std::pair<double, std::string_view>>& candidates, const size_t topSize) {
+        size_t size = 0;
+        for (size_t i = 0; i < candidates.size() && size < topSize; ++i) {
+            const auto kept = std::find_if(candidates.begin(), candidates.begin() + size, [&](const auto& candidate) {
+                return candidate.second == candidates[i].second;
+            });
+            if (kept == candidates.begin() + size) {
+                candidates[size++] = candidates[i];
             }
-            while (found.size() == clustersLimit) {
-                found.clear();
-                distanceLimit *= 0.9;
-                found = dict.ClustersVPTree->FindNearbyItems(shortEmbedding, distanceLimit, clustersLimit);
+        }
+        candidates.resize(size);
+    }
+
+    // Batched GetCandidates: the cluster index is searched for all cache
+    // misses of the block together, see TClusterIndex::FindClusters.
+    std::vector<std::vector<std::pair<double, std::string_view>>> GetCandidates(
+        const std::vector<TSwipeEvent>& swipeEvents,
+        const TDict& dict,
+        const TSearchParams& params,
+        TResultCache* cache = nullptr,
+        const TDictOverlay* overlay = nullptr) const
+    {
+        std::vector<std::vector<std::pair<double, std::string_view>>> results(swipeEvents.size());
+
+        std::vector<std::vector<TCoord>> points(swipeEvents.size());
+        std::vector<TShortEmbedding> shortEmbeddings(swipeEvents.size());
+        std::vector<TResultCache::TKey> keys(cache ? swipeEvents.size() : 0);
+
+        std::vector<size_t> misses;
+        for (size_t i = 0; i < swipeEvents.size(); ++i) {
+            points[i] = MakePoints(swipeEvents[i]);
+            shortEmbeddings[i].Coords = dict.ShortenEmbedding(points[i]);
+            if (cache) {
+                keys[i] = cache->MakeKey(Id, KeyWidth(), shortEmbeddings[i].Coords);
+                if (cache->Find(keys[i], results[i])) {
+                    continue;
+                }
+            }
+            misses.push_back(i);
+        }
+
+        std::vector<std::vector<std::pair<double, std::string_view>>> missResults = GetCandidates(points, shortEmbeddings, misses, dict, params);
+        for (size_t i = 0; i < misses.size(); ++i) {
+            const size_t idx = misses[i];
+            results[idx].swap(missResults[i]);
+            if (cache) {
+                cache->Insert(keys[idx], results[idx]);
             }
         }
 
-        std::vector<std::pair<double, std::wstring>> allCandidates;
+        if (overlay) {
+            for (size_t i = 0; i < swipeEvents.size(); ++i) {
+                MergeCandidates(results[i], ScoreOverlay(points[i], *overlay, params), params.TopSize);
+            }
+        }
+
+        return results;
+    }
+
+    // Batch of swipes already turned into points: decodes the swipes at
+    // the given positions in points and shortEmbeddings, in that order.
+    std::vector<std::vector<std::pair<double, std::string_view>>> GetCandidates(
+        const std::vector<std::vector<TCoord>>& points,
+        const std::vector<TShortEmbedding>& shortEmbeddings,
+        const std::vector<size_t>& swipes,
+        const TDict& dict,
+        const TSearchParams& params) const
+    {
+        std::vector<const TShortEmbedding*> queries;
+        for (const size_t idx : swipes) {
+            queries.push_back(&shortEmbeddings[idx]);
+        }
+
+        const std::vector<std::vector<TShortEmbedding*>> found = dict.ClusterIndex->FindClusters(queries, params.ClustersLimit);
+        std::vector<std::vector<std::pair<double, std::string_view>>> results(swipes.size());
+        for (size_t i = 0; i < swipes.size(); ++i) {
+            results[i] = ScoreClusters(points[swipes[i]], shortEmbeddings[swipes[i]], found[i], dict, params);
+        }
+        return results;
+    }
+
+    std::vector<std::pair<double, std::string_view>> GetCandidates(
+        const std::vector<TCoord>& points,
+        const TShortEmbedding& shortEmbedding,
+        const TDict& dict,
+        const TSearchParams& params) const
+    {
+        return ScoreClusters(points, shortEmbedding, dict.ClusterIndex->FindClusters(shortEmbedding, params.ClustersLimit), dict, params);
+    }
+
+    std::vector<std::pair<double, std::string_view>> ScoreClusters(
+        const std::vector<TCoord>& points,
+        const TShortEmbedding& shortEmbedding,
+        const std::vector<TShortEmbedding*>& found,
+        const TDict& dict,
+        const TSearchParams& params) const
+    {
+        std::vector<std::pair<double, size_t>> probes;
         for (const TShortEmbedding* foundCluster : found) {
-            const std::vector<TDict::TWordIndex>& cluster = dict.ClusterWords[foundCluster->Idx];
-            for (const TDict::TWordIndex wordIndex : cluster) {
-                const std::wstring& candidate = dict.Words[wordIndex];
-                const double score = Score(candidate, points);
+            probes.push_back(std::make_pair(dict.Kernels->ShortDistance(shortEmbedding.Coords, foundCluster->Coords), foundCluster->Idx));
+        }
+        std::sort(probes.begin(), probes.end());
+
+        const TClusterStorage& storage = dict.GetStorage();
+
+        const bool useQuantizer = dict.Quantizer && params.RescoreCount;
+        std::vector<float> lookupTable;
+        if (useQuantizer) {
+            dict.Quantizer->BuildLookupTable(points.data(), lookupTable);
+        }
+
+        // candidates by quantized distance: distance, cluster and position in its block
+        std::vector<std::pair<float, std::pair<size_t, size_t>>> approximateCandidates;
+
+        const bool filterKeys = params.KeyFilterRadius > 0. && KeyRects.size() <= MaskedKeysCount;
+        const TKeyMask unreachableKeys = filterKeys ? ~GetReachableKeys(points, params.KeyFilterRadius * KeyWidth()) : 0;
+        std::vector<char> passed;
+
+        size_t scoredWords = 0;
+        size_t prefetched = 0;
+        std::vector<std::pair<double, std::string_view>> allCandidates;
+        for (size_t probeIdx = 0; probeIdx < probes.size(); ++probeIdx) {
+            for (; prefetched < probes.size() && prefetched <= probeIdx + params.PrefetchClusters; ++prefetched) {
+                storage.Prefetch(probes[prefetched].second);
+            }
+
+            const TClusterBlock block = storage.GetBlock(probes[probeIdx].second);
+            size_t passedCount = block.Size;
+            if (filterKeys) {
+                passed.resize(block.Size);
+                passedCount = FilterByKeys(block, unreachableKeys, params.KeyFilterMisses, passed.data());
+            }
+
+            if (params.WordsBudget && probeIdx > 0 && scoredWords + passedCount > params.WordsBudget) {
+                break;
+            }
+            scoredWords += passedCount;
+
+            for (size_t i = 0; i < block.Size; ++i) {
+                if ((filterKeys && !passed[i]) || dict.IsGroupRemoved(block.Words[i])) {
+                    continue;
+                }
+                if (useQuantizer) {
+                    const float distance = dict.Quantizer->Distance(dict.GetWordCode(block.Words[i]), lookupTable.data());
+                    approximateCandidates.push_back(std::make_pair(distance, std::make_pair(probes[probeIdx].second, i)));
+                    continue;
+                }
+                const double score = Kernels->Score(block.Embeddings + i * Kernels->Length, points.data());
+
+                AddGroupCandidates(score, block.Words[i], dict, allCandidates);
+            }
+        }
+
+        if (useQuantizer) {
+            const size_t rescoreCount = std::min(params.RescoreCount, approximateCandidates.size());
+            std::partial_sort(approximateCandidates.begin(), approximateCandidates.begin() + rescoreCount, approximateCandidates.end());
+            for (size_t i = 0; i < rescoreCount; ++i) {
+                const TClusterBlock block = storage.GetBlock(approximateCandidates[i].second.first);
+                const size_t position = approximateCandidates[i].second.second;
+                const double score = Kernels->Score(block.Embeddings + position * Kernels->Length, points.data());
 
-                allCandidates.push_back(std::make_pair(score, candidate));
+                AddGroupCandidates(score, block.Words[position], dict, allCandidates);
             }
         }
-        std::sort(allCandidates.begin(), allCandidates.end(), std::greater<>());
-        if (allCandidates.size() > 10) {
-            allCandidates.resize(10);
+        // words of one group tie, the stable sort keeps them in dict order
+        std::stable_sort(allCandidates.begin(), allCandidates.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first > rhs.first;
+        });
+        if (allCandidates.size() > params.TopSize) {
+            allCandidates.resize(params.TopSize);
         }
 
         return allCandidates;
     }
 
+    // one pass over the masks of a block without branches, so that it
+    // vectorizes; returns the number of words passed
+    static size_t FilterByKeys(const TClusterBlock& block, const TKeyMask unreachableKeys, const size_t maxMisses, char* passed) {
+        size_t passedCount = 0;
+        if (!maxMisses) {
+            for (size_t i = 0; i < block.Size; ++i) {
+                passed[i] = (block.KeyMasks[i] & unreachableKeys) == 0;
+                passedCount += passed[i];
+            }
+        } else {
+            for (size_t i = 0; i < block.Size; ++i) {
+                passed[i] = static_cast<size_t>(__builtin_popcountll(block.KeyMasks[i] & unreachableKeys)) <= maxMisses;
+                passedCount += passed[i];
+            }
+        }
+        return passedCount;
+    }
+
+    // keys whose rectangles are within radius of some of the points, only
+    // key ids below MaskedKeysCount get a bit
+    TKeyMask GetReachableKeys(const std::vector<TCoord>& points, const double radius) const {
+        const size_t keysCount = std::min<size_t>(KeyRects.size(), MaskedKeysCount);
+        const double squaredRadius = radius * radius;
+
+        TKeyMask reachable = 0;
+        for (const TCoord& point : points) {
+            for (size_t keyId = 0; keyId < keysCount; ++keyId) {
+                const TKeyInfo& rect = KeyRects[keyId];
+                const double xDiff = std::max(std::max(rect.LeftUpper.X - point.X, point.X - rect.LeftUpper.X - rect.Width), 0.);
+                const double yDiff = std::max(std::max(rect.LeftUpper.Y - point.Y, point.Y - rect.LeftUpper.Y - rect.Height), 0.);
+                if (xDiff * xDiff + yDiff * yDiff <= squaredRadius) {
+                    reachable |= TKeyMask(1) << keyId;
+                }
+            }
+        }
+        return reachable;
+    }
+
+    static TKeyMask GetKeyMask(const TKeyPath& path) {
+        TKeyMask mask = 0;
+        for (size_t i = 0; i < path.Size; ++i) {
+            if (path.Keys[i] < MaskedKeysCount) {
+                mask |= TKeyMask(1) << path.Keys[i];
+            }
+        }
+        return mask;
+    }
+
+    static void AddGroupCandidates(
+        const double score,
+        const TDict::TWordIndex representative,
+        const TDict& dict,
+        std::vector<std::pair<double, std::string_view>>& candidates)
+    {
+        for (TDict::TWordIndex wordIdx = representative; wordIdx != TDict::NoWord; wordIdx = dict.NextSibling[wordIdx]) {
+            if (!dict.IsRemoved(wordIdx)) {
+                candidates.push_back(std::make_pair(score, dict.Words[wordIdx]));
+            }
+        }
+    }
+
+    double KeyWidth() const {
+        return MeanKeyWidth;
+    }
+
     double Score(const std::wstring& candidate, const std::vector<TCoord> points) const {
         const std::vector<TCoord> candidatePoints = MakePoints(candidate);
         return Score(candidatePoints, points);
@@ -183,25 +503,77 @@ public:
         return Score(candidatePoints, points);
     }
 
+    double Score(const TKeyPath& candidate, const std::vector<TCoord>& points) const {
+        const std::vector<TCoord> candidatePoints = MakePoints(candidate);
+        return Score(candidatePoints, points);
+    }
+
+    TKeyId GetKeyId(const wchar_t symbol) const {
+        const size_t idx = static_cast<size_t>(symbol);
+        return idx < KeyIdsBySymbol.size() ? KeyIdsBySymbol[idx] : InvalidKeyId;
+    }
+
+    std::vector<TKeyId> EncodeWord(const std::string_view text) const {
+        return EncodeWord(DecodeUtf8(text));
+    }
+
+    std::vector<TKeyId> EncodeWord(const std::wstring& text) const {
+        std::vector<TKeyId> keys;
+        for (const wchar_t symbol : text) {
+            const TKeyId keyId = GetKeyId(symbol);
+            if (keyId == InvalidKeyId) {
+                continue;
+            }
+            if (CollapseRepeatedKeys && !keys.empty() && keys.back() == keyId) {
+                continue;
+            }
+            keys.push_back(keyId);
+        }
+        return keys;
+    }
+
+    void EncodeWords(TDict& dict) const {
+        dict.WordKeys.clear();
+        dict.WordKeyOffsets.assign(1, 0);
+        for (const std::string_view word : dict.Words) {
+            const std::vector<TKeyId> keys = EncodeWord(word);
+            dict.WordKeys.insert(dict.WordKeys.end(), keys.begin(), keys.end());
+            dict.WordKeyOffsets.push_back(dict.WordKeys.size());
+        }
+        dict.GroupWords();
+    }
+
     std::vector<TCoord> NeededPoints(const std::wstring text) const {
         std::vector<TCoord> neededPoints;
         for (size_t i = 0; i < text.size(); ++i) {
-            TKeyInfosMap::const_iterator it = KeyInfos.find(text[i]);
-            if (it == KeyInfos.end()) {
+            const TKeyId keyId = GetKeyId(text[i]);
+            if (keyId == InvalidKeyId) {
                 continue;
             }
 
-            neededPoints.push_back(it->second.Center());
+            neededPoints.push_back(KeyCenters[keyId]);
+        }
+        return neededPoints;
+    }
+
+    std::vector<TCoord> NeededPoints(const TKeyPath& path) const {
+        std::vector<TCoord> neededPoints(path.Size);
+        for (size_t i = 0; i < path.Size; ++i) {
+            neededPoints[i] = KeyCenters[path.Keys[i]];
         }
         return neededPoints;
     }
 
     std::vector<TCoord> MakePoints(const std::wstring text) const {
-        return ProducePoints(NeededPoints(text), EmbeddingLength);
+        return ProducePoints(NeededPoints(text), Kernels->Length);
+    }
+
+    std::vector<TCoord> MakePoints(const TKeyPath& path) const {
+        return ProducePoints(NeededPoints(path), Kernels->Length);
     }
 
     std::vector<TCoord> MakePoints(const TSwipeEvent& evt) const {
-        return ProducePoints(evt.Points, EmbeddingLength);
+        return ProducePoints(evt.Points, Kernels->Length);
     }
 
     double Distance(const TCoord& lhs, const TCoord& rhs) const {
@@ -262,33 +634,74 @@ public:
         return std::max(AsymmetricDistance(lhs, rhs), AsymmetricDistance(rhs, lhs));
     }
 
+    double KeyDistance(const TKeyId lhs, const TKeyId rhs) const {
+        return KeyDistances[lhs * KeyCenters.size() + rhs];
+    }
+
+    std::vector<TKeyId> GetInterestingKeys(const TKeyPath& path) const {
+        std::vector<TKeyId> result;
+        if (!path.Size) {
+            return result;
+        }
+
+        result.push_back(path.Keys[0]);
+        for (size_t i = 0; i + 2 < path.Size; ++i) {
+            if (Cosine(KeyCenters[path.Keys[i]], KeyCenters[path.Keys[i + 1]], KeyCenters[path.Keys[i + 2]]) < 0) {
+                result.push_back(path.Keys[i + 1]);
+            }
+        }
+        result.push_back(path.Keys[path.Size - 1]);
+
+        return result;
+    }
+
+    double AsymmetricDistance(const std::vector<TKeyId>& lhs, const std::vector<TCoord>& rhs) const {
+        size_t rLast = 0;
+        double distance = 0.;
+        for (size_t i = 0; i < lhs.size(); ++i) {
+            const TCoord& center = KeyCenters[lhs[i]];
+            double bestDistance = Distance(center, rhs[rLast]);
+            size_t bestNext = rLast;
+            for (size_t j = rLast + 1; j < rhs.size(); ++j) {
+                const double curDistance = Distance(center, rhs[j]);
+                if (curDistance < bestDistance) {
+                    bestDistance = curDistance;
+                    bestNext = j;
+                }
+            }
+            rLast = bestNext;
+            distance += bestDistance;
+        }
+
+        return distance;
+    }
+
     double Score(const std::vector<TCoord>& modifiedNeededPoints,
                  const std::vector<TCoord>& modifiedObservedPoints) const
     {
         //const std::vector<TCoord> interestingNeededPoints = GetInterestingPoints(modifiedNeededPoints);
         //const std::vector<TCoord> interestingObservedPoints = GetInterestingPoints(modifiedObservedPoints);
 
-        double distance = 0.;
-        for (size_t i = 0; i < modifiedNeededPoints.size(); ++i) {
-            const double xDiff = modifiedNeededPoints[i].X - modifiedObservedPoints[i].X;
-            const double yDiff = modifiedNeededPoints[i].Y - modifiedObservedPoints[i].Y;
-
-            distance += xDiff * xDiff + yDiff * yDiff;
-        }
-
-        return -distance;
+        return Kernels->Score(modifiedNeededPoints, modifiedObservedPoints);
     }
 
     void LoadFromString(const std::wstring& source) {
         std::vector<std::wstring> parts;
         std::wstring current;
 
+        // a key is x:y:width:height:symbol
         auto add = [&](){
+            if (parts.size() < 4 || current.empty()) {
+                parts.clear();
+                current.clear();
+                return;
+            }
+
             TKeyInfo keyInfo;
             keyInfo.LeftUpper.X = stod(parts[0]);
             keyInfo.LeftUpper.Y = stod(parts[1]);
-            keyInfo.Width = stod(parts[1]);
-            keyInfo.Height = stod(parts[1]);
+            keyInfo.Width = stod(parts[2]);
+            keyInfo.Height = stod(parts[3]);
 
             KeyInfos[current.front()] = keyInfo;
 
@@ -296,6 +709,8 @@ public:
             current.clear();
         };
 
+        Id = std::hash<std::wstring>()(source.substr(0, source.find('\t')));
+
         for (size_t i = 0; i < source.size(); ++i) {
             if (source[i] == '\t') {
                 add();
@@ -312,42 +727,380 @@ public:
             }
             current += source[i];
         }
+
+        BuildKeyTables();
     }
 
-    void BuildVPTree(TDict& dict) {
-        dict.ClustersVPTree = std::unique_ptr<TDict::TDictVPTree>(new TDict::TDictVPTree(ClusterEmbeddings.begin(), ClusterEmbeddings.end(), TEmbeddingMetric()));
+    void BuildKeyTables() {
+        Keys.clear();
+        for (const auto& keyInfo : KeyInfos) {
+            Keys.push_back(keyInfo.first);
+        }
+        std::sort(Keys.begin(), Keys.end());
+        if (Keys.size() >= InvalidKeyId) {
+            Keys.resize(InvalidKeyId);
+        }
+
+        KeyIdsBySymbol.assign(Keys.empty() ? 0 : static_cast<size_t>(Keys.back()) + 1, InvalidKeyId);
+        KeyCenters.clear();
+        KeyRects.clear();
+        TMeanCalculator width;
+        for (size_t keyId = 0; keyId < Keys.size(); ++keyId) {
+            KeyIdsBySymbol[static_cast<size_t>(Keys[keyId])] = keyId;
+            KeyRects.push_back(KeyInfos.find(Keys[keyId])->second);
+            KeyCenters.push_back(KeyRects.back().Center());
+            width.Add(KeyRects.back().Width);
+        }
+        MeanKeyWidth = width.GetMean();
+
+        KeyDistances.resize(KeyCenters.size() * KeyCenters.size());
+        for (size_t lhs = 0; lhs < KeyCenters.size(); ++lhs) {
+            for (size_t rhs = 0; rhs < KeyCenters.size(); ++rhs) {
+                KeyDistances[lhs * KeyCenters.size() + rhs] = Distance(KeyCenters[lhs], KeyCenters[rhs]);
+            }
+        }
     }
 
-    void MakeClusters(TDict& dict, const size_t clustersCount, const size_t iterationsCount) {
-        std::vector<std::vector<TCoord>> wordEmbeddings;      // :)
-        std::vector<std::vector<TCoord>> shortWordEmbeddings; // :)
+    bool BuildClusterIndex(TDict& dict, const std::string& indexPath = std::string()) const {
+        dict.ClusterIndex = MakeClusterIndex(IndexParams, dict.ClusterEmbeddings, Kernels, indexPath);
+        return dict.ClusterIndex != nullptr;
+    }
 
-        {
-            for (const std::wstring& word: dict.Words) {
-                wordEmbeddings.push_back(MakePoints(word));
-                shortWordEmbeddings.push_back(TDict::ShortenEmbedding(wordEmbeddings.back()));
+    // Fills dict.Storage with cluster blocks of words and their embeddings,
+    // kept in memory or, if storagePath is given, written there and mapped.
+    bool BuildClusterStorage(TDict& dict, const std::string& storagePath = std::string()) const {
+        auto makeEmbeddings = [&](const std::vector<TDict::TWordIndex>& clusterWords) {
+            std::vector<TCoord> embeddings;
+            embeddings.reserve(clusterWords.size() * Kernels->Length);
+            for (const TDict::TWordIndex wordIdx : clusterWords) {
+                const std::vector<TCoord> embedding = MakePoints(dict.GetWordKeys(wordIdx));
+                embeddings.insert(embeddings.end(), embedding.begin(), embedding.end());
             }
+            return embeddings;
+        };
+        auto makeKeyMasks = [&](const std::vector<TDict::TWordIndex>& clusterWords) {
+            std::vector<TKeyMask> keyMasks;
+            keyMasks.reserve(clusterWords.size());
+            for (const TDict::TWordIndex wordIdx : clusterWords) {
+                keyMasks.push_back(GetKeyMask(dict.GetWordKeys(wordIdx)));
+            }
+            return keyMasks;
+        };
+
+        if (storagePath.empty()) {
+            std::unique_ptr<TMemoryClusterStorage> memoryStorage(new TMemoryClusterStorage(Kernels->Length));
+            for (const std::vector<TDict::TWordIndex>& clusterWords : dict.ClusterWords) {
+                memoryStorage->AddBlock(clusterWords, makeKeyMasks(clusterWords), makeEmbeddings(clusterWords));
+            }
+            dict.Storage = std::move(memoryStorage);
+            return true;
         }
 
-        dict.ClusterCenters = shortWordEmbeddings;
+        std::unique_ptr<TMappedClusterStorage::TWriter> writer(new TMappedClusterStorage::TWriter(storagePath, Kernels->Length));
+        for (const std::vector<TDict::TWordIndex>& clusterWords : dict.ClusterWords) {
+            writer->AddBlock(clusterWords, makeKeyMasks(clusterWords), makeEmbeddings(clusterWords));
+        }
 
-        std::mt19937_64 mersenne;
-        std::shuffle(dict.ClusterCenters.begin(), dict.ClusterCenters.end(), mersenne);
-        if (dict.ClusterCenters.size() > clustersCount) {
+        if (!writer->Finish(dict.ClusterCenters, GetModelHash(dict))) {
+            std::cerr << "cannot write cluster storage " << storagePath << std::endl;
+            return false;
+        }
+        dict.Storage = TMappedClusterStorage::Open(storagePath, Kernels->Length, Kernels->ShortLength);
+        if (!dict.Storage) {
+            return false;
+        }
+
+        // the mapped blocks are the only copy of cluster words from now on
+        std::vector<std::vector<TDict::TWordIndex>>().swap(dict.ClusterWords);
+        return true;
+    }
+
+    // Opens cluster storage written by BuildClusterStorage for the same words
+    // and layout in place of clustering: centers come from the file and the
+    // update statistics from its blocks, words are never held in memory as
+    // clusters. False if the file is missing, corrupt or built for others.
+    bool OpenClusterStorage(TDict& dict, const std::string& storagePath) const {
+        dict.Kernels = Kernels;
+        EncodeWords(dict);
+
+        std::unique_ptr<TMappedClusterStorage> storage = TMappedClusterStorage::Open(storagePath, Kernels->Length, Kernels->ShortLength);
+        if (!storage) {
+            return false;
+        }
+        if (storage->GetModelHash() != GetModelHash(dict)) {
+            std::cerr << "cluster storage " << storagePath << " was built for other words or layout" << std::endl;
+            return false;
+        }
+
+        dict.ClusterCenters = storage->GetClusterCenters();
+        dict.ClusterWords.clear();
+        dict.ResetClusterStats(dict.Words.GetSize());
+        for (size_t clusterId = 0; clusterId < storage->GetClustersCount(); ++clusterId) {
+            const TClusterBlock block = storage->GetBlock(clusterId);
+            for (size_t i = 0; i < block.Size; ++i) {
+                if (block.Words[i] >= dict.Words.GetSize() || !dict.IsRepresentative(block.Words[i])) {
+                    std::cerr << "cluster storage " << storagePath << " does not match key path groups" << std::endl;
+                    return false;
+                }
+                const std::vector<TCoord> embedding(block.Embeddings + i * Kernels->Length, block.Embeddings + (i + 1) * Kernels->Length);
+                dict.AddToClusterStats(block.Words[i], clusterId, dict.ShortenEmbedding(embedding));
+            }
+        }
+        dict.Storage = std::move(storage);
+        dict.UpdateClusterEmbeddings();
+        std::cerr << "opened cluster storage " << storagePath << " with " << dict.ClusterCenters.size() << " clusters" << std::endl;
+        return true;
+    }
+
+    // identifies the words and the layout geometry cluster storage is built for
+    uint64_t GetModelHash(const TDict& dict) const {
+        uint64_t hash = Id;
+        auto combine = [&hash](const uint64_t value) {
+            hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+        };
+        combine(CollapseRepeatedKeys);
+        combine(Kernels->Length);
+        combine(Kernels->ShortLength);
+        for (const std::string_view word : dict.Words) {
+            combine(std::hash<std::string_view>()(word));
+        }
+        return hash;
+    }
+
+    // With warmStart, centers already in dict.ClusterCenters, e.g. saved by
+    // the previous build, are refined in place of fresh seeds, so clusters
+    // keep their ids and clustersCount is ignored. Iterations stop early
+    // once a pass moves at most maxChurn of the words.
+    void MakeClusters(
+        TDict& dict,
+        size_t clustersCount,
+        const size_t iterationsCount,
+        const size_t maxClusterSize = 0,
+        const double maxChurn = 0.,
+        const bool warmStart = false) const
+    {
+        dict.Kernels = Kernels;
+        EncodeWords(dict);
+
+        // clusters are made of group representatives, the positions in
+        // representatives become word indices once the clusters are final
+        const std::vector<TDict::TWordIndex> representatives = dict.GetLiveRepresentatives();
+        std::cerr << "key path groups: " << representatives.size() << " for " << dict.Words.GetSize() << " words" << std::endl;
+
+        std::vector<std::vector<TCoord>> shortWordEmbeddings;
+        shortWordEmbeddings.reserve(representatives.size());
+        for (const TDict::TWordIndex wordIdx : representatives) {
+            shortWordEmbeddings.push_back(dict.ShortenEmbedding(MakePoints(dict.GetWordKeys(wordIdx))));
+        }
+
+        if (warmStart) {
+            clustersCount = std::min(dict.ClusterCenters.size(), shortWordEmbeddings.size());
             dict.ClusterCenters.resize(clustersCount);
+        } else {
+            clustersCount = std::min(clustersCount, shortWordEmbeddings.size());
+
+            std::mt19937_64 mersenne;
+            dict.SeedClusterCenters(clustersCount, shortWordEmbeddings, mersenne);
+        }
+
+        dict.RefineClusters(iterationsCount, maxChurn, shortWordEmbeddings, maxClusterSize);
+
+        dict.RemapClusterWords(representatives);
+        dict.UpdateClusterStats(SpreadByWords(shortWordEmbeddings, representatives, dict.Words.GetSize()));
+
+        size_t largestCluster = 0;
+        for (const std::vector<TDict::TWordIndex>& clusterWords : dict.ClusterWords) {
+            largestCluster = std::max(largestCluster, clusterWords.size());
+        }
+        std::cerr << "largest cluster: " << largestCluster << " words" << std::endl;
+
+        dict.UpdateClusterEmbeddings();
+    }
+
+    static std::vector<std::vector<TCoord>> SpreadByWords(
+        std::vector<std::vector<TCoord>>& embeddings,
+        const std::vector<TDict::TWordIndex>& words,
+        const size_t wordsCount)
+    {
+        std::vector<std::vector<TCoord>> byWords(wordsCount);
+        for (size_t i = 0; i < words.size(); ++i) {
+            byWords[words[i]].swap(embeddings[i]);
         }
+        return byWords;
+    }
+
+    // Mini-batch k-means for dictionaries too large for full Lloyd passes:
+    // short embeddings exist only for the seeding sample and the current
+    // batch, the final assignment is one streaming pass over the dict.
+    void MakeClustersMiniBatch(TDict& dict, size_t clustersCount, const size_t iterationsCount, const size_t batchSize, const size_t maxClusterSize = 0) const {
+        dict.Kernels = Kernels;
+        EncodeWords(dict);
+
+        const size_t wordsCount = dict.Words.GetSize();
+        clustersCount = std::min(clustersCount, wordsCount);
+        if (!clustersCount) {
+            dict.ClusterCenters.clear();
+            dict.ClusterWords.clear();
+            dict.ResetClusterStats(0);
+            dict.UpdateClusterEmbeddings();
+            return;
+        }
+
+        std::mt19937_64 mersenne;
+        auto sampleShortEmbeddings = [&](const size_t count) {
+            std::vector<std::vector<TCoord>> shortEmbeddings;
+            shortEmbeddings.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                const TDict::TWordIndex wordIdx = mersenne() % wordsCount;
+                shortEmbeddings.push_back(dict.ShortenEmbedding(MakePoints(dict.GetWordKeys(wordIdx))));
+            }
+            return shortEmbeddings;
+        };
 
+        {
+            const std::vector<std::vector<TCoord>> seedSample = sampleShortEmbeddings(std::max(3 * clustersCount, batchSize));
+            dict.SeedClusterCenters(clustersCount, seedSample, mersenne);
+        }
+
+        std::vector<size_t> centerCounts;
         for (size_t iteration = 0; iteration < iterationsCount; ++iteration) {
-            dict.UpdateClusterWords(clustersCount, shortWordEmbeddings);
-            dict.UpdateClusterCenters(clustersCount, shortWordEmbeddings);
+            dict.UpdateClusterCentersMiniBatch(sampleShortEmbeddings(batchSize), centerCounts);
         }
 
-        for (const std::vector<TCoord>& clusterCenter : dict.ClusterCenters) {
-            TShortEmbedding clusterEmbedding;
-            clusterEmbedding.Coords = clusterCenter;
-            clusterEmbedding.Idx = ClusterEmbeddings.size();
+        // streaming assignment; with a size cap a word overflowing its
+        // nearest cluster goes to the nearest one with room left
+        const size_t capacity = maxClusterSize ? std::max(maxClusterSize, (wordsCount + clustersCount - 1) / clustersCount) : 0;
+        double sumBestDistances = 0.;
+        dict.ClusterWords.assign(clustersCount, {});
+        dict.ResetClusterStats(wordsCount);
+        size_t groupsCount = 0;
+        for (size_t wordIdx = 0; wordIdx < wordsCount; ++wordIdx) {
+            if (!dict.IsRepresentative(wordIdx)) {
+                continue;
+            }
+            ++groupsCount;
+
+            const std::vector<TCoord> shortEmbedding = dict.ShortenEmbedding(MakePoints(dict.GetWordKeys(wordIdx)));
+            std::pair<size_t, double> best = dict.GetClusterForShort(shortEmbedding);
+            if (capacity && dict.ClusterWords[best.first].size() >= capacity) {
+                best = std::make_pair(clustersCount, std::numeric_limits<double>::max());
+                for (size_t clusterId = 0; clusterId < clustersCount; ++clusterId) {
+                    if (dict.ClusterWords[clusterId].size() >= capacity) {
+                        continue;
+                    }
+                    const double distance = Kernels->ShortDistance(shortEmbedding, dict.ClusterCenters[clusterId]);
+                    if (distance < best.second) {
+                        best = std::make_pair(clusterId, distance);
+                    }
+                }
+            }
 
-            ClusterEmbeddings.push_back(clusterEmbedding);
+            dict.ClusterWords[best.first].push_back(wordIdx);
+            dict.AddToClusterStats(wordIdx, best.first, shortEmbedding);
+            sumBestDistances += best.second;
+        }
+        std::cerr << "key path groups: " << groupsCount << " for " << wordsCount << " words" << std::endl;
+        std::cerr << "score: " << (sumBestDistances / std::max<size_t>(groupsCount, 1)) << std::endl;
+
+        size_t largestCluster = 0;
+        for (const std::vector<TDict::TWordIndex>& clusterWords : dict.ClusterWords) {
+            largestCluster = std::max(largestCluster, clusterWords.size());
+        }
+        std::cerr << "largest cluster: " << largestCluster << " words" << std::endl;
+
+        dict.UpdateClusterEmbeddings();
+    }
+
+    // Trains dict.Quantizer on a sample of word embeddings and encodes all words.
+    // false and no quantizer for a dict without words to train on
+    bool TrainQuantizer(TDict& dict, const size_t segmentsCount, const size_t samplesCount, const size_t iterationsCount) const {
+        std::mt19937_64 mersenne;
+
+        const size_t sampledCount = std::min(samplesCount, dict.Words.GetSize());
+        std::vector<TCoord> samples;
+        samples.reserve(sampledCount * Kernels->Length);
+        for (size_t i = 0; i < sampledCount; ++i) {
+            const TDict::TWordIndex wordIdx = sampledCount == dict.Words.GetSize() ? i : mersenne() % dict.Words.GetSize();
+            const std::vector<TCoord> embedding = MakePoints(dict.GetWordKeys(wordIdx));
+            samples.insert(samples.end(), embedding.begin(), embedding.end());
+        }
+
+        dict.Quantizer.reset(new TProductQuantizer());
+        if (!dict.Quantizer->Train(samples, sampledCount, Kernels->Length, segmentsCount, iterationsCount, mersenne)) {
+            dict.Quantizer.reset();
+            dict.WordCodes.clear();
+            return false;
+        }
+
+        const size_t codeSize = dict.Quantizer->GetSegmentsCount();
+        dict.WordCodes.assign(dict.Words.GetSize() * codeSize, 0);
+        for (size_t wordIdx = 0; wordIdx < dict.Words.GetSize(); ++wordIdx) {
+            dict.Quantizer->Encode(MakePoints(dict.GetWordKeys(wordIdx)).data(), dict.WordCodes.data() + wordIdx * codeSize);
+        }
+        return true;
+    }
+
+    // Adds a word to a clustered dict without re-clustering: the word joins
+    // its nearest cluster. Read-only (mapped or packed) cluster storage gets
+    // an in-memory overlay for the clusters words are added to.
+    bool AddWord(TDict& dict, const std::string_view word) const {
+        const std::vector<TKeyId> keys = EncodeWord(word);
+        if (keys.empty()) {
+            return false;
+        }
+
+        TKeyPath path;
+        path.Keys = keys.data();
+        path.Size = keys.size();
+        const std::vector<TCoord> embedding = MakePoints(path);
+        const std::vector<TCoord> shortEmbedding = dict.ShortenEmbedding(embedding);
+
+        const TDict::TWordIndex wordIdx = dict.Words.GetSize();
+        // a word joining a live group needs no cluster slot of its own
+        const TDict::TWordIndex representative = dict.FindGroup(path);
+        size_t clusterId = 0;
+        if (representative == TDict::NoWord) {
+            // a dict built without words has no cluster to join
+            if (dict.ClusterCenters.empty()) {
+                return false;
+            }
+            clusterId = dict.GetClusterForShort(shortEmbedding).first;
+            dict.AddToClusterStorage(wordIdx, clusterId, GetKeyMask(path), embedding.data());
+        }
+
+        if (dict.Quantizer) {
+            dict.WordCodes.resize(dict.WordCodes.size() + dict.Quantizer->GetSegmentsCount());
+            dict.Quantizer->Encode(embedding.data(), dict.WordCodes.data() + wordIdx * dict.Quantizer->GetSegmentsCount());
+        }
+
+        dict.Words.Add(word);
+        dict.WordKeys.insert(dict.WordKeys.end(), keys.begin(), keys.end());
+        dict.WordKeyOffsets.push_back(dict.WordKeys.size());
+        dict.AddToGroup(wordIdx);
+        dict.Removed.resize(wordIdx + 1, 0);
+        dict.WordClusters.resize(wordIdx + 1, 0);
+        if (representative == TDict::NoWord) {
+            dict.AddToClusterStats(wordIdx, clusterId, shortEmbedding);
+        }
+        return true;
+    }
+
+    // Marks all live copies of the word as removed.
+    bool RemoveWord(TDict& dict, const std::string_view word) const {
+        bool removed = false;
+        for (TDict::TWordIndex wordIdx = 0; wordIdx < dict.Words.GetSize(); ++wordIdx) {
+            if (dict.Words[wordIdx] != word || dict.IsRemoved(wordIdx)) {
+                continue;
+            }
+
+            dict.Removed[wordIdx] = 1;
+            removed = true;
+
+            const TDict::TWordIndex representative = dict.Representatives[wordIdx];
+            if (dict.IsGroupRemoved(representative)) {
+                dict.RemoveFromClusterStats(representative, dict.ShortenEmbedding(MakePoints(dict.GetWordKeys(representative))));
+            }
         }
+        return removed;
     }
 };
@@ -0,0 +1,87 @@
+#include "thread_pool.h"
+
+#include "placement.h"
+
+void TThreadPool::TJob::RunTasks() {
+    for (size_t idx = Next++; idx < Count; idx = Next++) {
+        (*Task)(idx);
+        if (++Done == Count) {
+            std::lock_guard<std::mutex> guard(Mutex);
+            Finished.notify_all();
+        }
+    }
+}
+
+TThreadPool::TThreadPool(const size_t threadsCount, const size_t numaNodesCount) {
+    for (size_t i = 0; i < threadsCount; ++i) {
+        Threads.emplace_back([this, numaNodesCount, i]() {
+            WorkerLoop(numaNodesCount, i);
+        });
+    }
+}
+
+TThreadPool::~TThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(Mutex);
+        Stopping = true;
+    }
+    HasJobs.notify_all();
+    for (std::thread& thread : Threads) {
+        thread.join();
+    }
+}
+
+void TThreadPool::ParallelFor(const size_t count, const std::function<void(size_t)>& task) {
+    if (count <= 1 || Threads.empty()) {
+        for (size_t idx = 0; idx < count; ++idx) {
+            task(idx);
+        }
+        return;
+    }
+
+    std::shared_ptr<TJob> job(new TJob());
+    job->Task = &task;
+    job->Count = count;
+    job->Next = 0;
+    job->Done = 0;
+    {
+        std::lock_guard<std::mutex> guard(Mutex);
+        Jobs.push_back(job);
+    }
+    HasJobs.notify_all();
+
+    job->RunTasks();
+
+    // workers drop the job from the queue once it has no tasks left; the
+    // task itself is not touched after the last one is done
+    std::unique_lock<std::mutex> guard(job->Mutex);
+    job->Finished.wait(guard, [&]() {
+        return job->Done == count;
+    });
+}
+
+void TThreadPool::WorkerLoop(const size_t numaNodesCount, const size_t index) {
+    if (numaNodesCount) {
+        PinThreadToNumaNode(index % numaNodesCount);
+    }
+
+    std::unique_lock<std::mutex> guard(Mutex);
+    while (true) {
+        HasJobs.wait(guard, [this]() {
+            return Stopping || !Jobs.empty();
+        });
+        if (Jobs.empty()) {
+            return;
+        }
+
+        const std::shared_ptr<TJob> job = Jobs.front();
+        if (job->Next >= job->Count) {
+            Jobs.pop_front();
+            continue;
+        }
+
+        guard.unlock();
+        job->RunTasks();
+        guard.lock();
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for fork-join fan-out. The calling thread of
+// ParallelFor works on its own tasks too, so a call never just waits for
+// busy workers and calls from many threads at once cannot deadlock.
+class TThreadPool {
+private:
+    struct TJob {
+        const std::function<void(size_t)>* Task = nullptr;
+        size_t Count = 0;
+        std::atomic<size_t> Next;
+        std::atomic<size_t> Done;
+
+        std::mutex Mutex;
+        std::condition_variable Finished;
+
+        void RunTasks();
+    };
+
+    std::mutex Mutex;
+    std::condition_variable HasJobs;
+    std::deque<std::shared_ptr<TJob>> Jobs;
+    bool Stopping = false;
+
+    std::vector<std::thread> Threads;
+public:
+    // with numaNodesCount set, worker i pins itself to node i % numaNodesCount
+    explicit TThreadPool(const size_t threadsCount, const size_t numaNodesCount = 0);
+    ~TThreadPool();
+
+    size_t GetThreadsCount() const {
+        return Threads.size();
+    }
+
+    // runs task(0), ..., task(count - 1) on the workers and the calling
+    // thread, returns once all of them are done
+    void ParallelFor(const size_t count, const std::function<void(size_t)>& task);
+private:
+    void WorkerLoop(const size_t numaNodesCount, const size_t index);
+};
@@ -1,6 +1,7 @@
 #include <algorithm>
 
 #include <list>
+#include <memory>
 #include <vector>
 
 #include <random>
@@ -54,8 +55,8 @@ public:
             Distances.push_back(TItemWithDistance(items[i], d));
         }
 
-        TItemWithDistance* beg = Distances.begin() + 1;
-        TItemWithDistance* end = Distances.end() - 1;
+        TItemWithDistance* beg = Distances.data() + 1;
+        TItemWithDistance* end = Distances.data() + Distances.size() - 1;
 
         // Move items with distance = 0 forward
         while (beg <= end) {
@@ -67,7 +68,7 @@ public:
             }
         }
 
-        innerNodeStart = beg - Distances.begin();
+        innerNodeStart = beg - Distances.data();
         const size_t remainingCount = count - innerNodeStart;
         outerNodeStart = innerNodeStart + nodeSplitFraction * remainingCount;
 
@@ -170,6 +171,26 @@ public:
         }
         return result;
     }
+
+    // Batched FindNearbyItems: the tree is descended once for the whole block
+    // of queries, every node computes distances for all queries still active
+    // there in one TMetric::Distances call and splits them between its
+    // subtrees. Each query gets exactly the items the single query search
+    // would return, in the same order.
+    std::vector<std::vector<T*>> FindNearbyItems(const std::vector<const T*>& items, const std::vector<double>& maxDistances, const size_t limit) {
+        std::vector<std::vector<T*>> results(items.size());
+        if (Nodes.empty()) {
+            return results;
+        }
+
+        std::vector<size_t> active(items.size());
+        for (size_t i = 0; i < active.size(); ++i) {
+            active[i] = i;
+        }
+
+        FindNearbyItems(*Nodes.front(), items, maxDistances, active, results, limit);
+        return results;
+    }
 private:
     TNode* BuildNode(T** items, const size_t count, std::vector<TNodeBuildParams>& nodesToBuild) {
         Nodes.push_back(std::shared_ptr<TNode>(new TNode()));
@@ -232,4 +253,67 @@ private:
 
         return FindNearbyItems(*node.Outer, item, maxDistance, results, limit);
     }
+
+    void FindNearbyItems(
+        TNode& node,
+        const std::vector<const T*>& items,
+        const std::vector<double>& maxDistances,
+        std::vector<size_t>& active,
+        std::vector<std::vector<T*>>& results,
+        const size_t limit)
+    {
+        active.erase(std::remove_if(active.begin(), active.end(), [&](const size_t query) {
+            return results[query].size() == limit;
+        }), active.end());
+        if (active.empty()) {
+            return;
+        }
+
+        std::vector<const T*> activeItems(active.size());
+        for (size_t i = 0; i < active.size(); ++i) {
+            activeItems[i] = items[active[i]];
+        }
+        std::vector<double> distances;
+
+        if (node.Inner == nullptr) {
+            for (size_t i = 0; i < node.Size; ++i) {
+                Metric.Distances(*node.Items[i], activeItems, distances);
+                for (size_t j = 0; j < active.size(); ++j) {
+                    const size_t query = active[j];
+                    if (results[query].size() < limit && distances[j] <= maxDistances[query]) {
+                        results[query].push_back(node.Items[i]);
+                    }
+                }
+            }
+            return;
+        }
+
+        Metric.Distances(**node.Items, activeItems, distances);
+
+        std::vector<size_t> innerActive;
+        std::vector<size_t> outerActive;
+        for (size_t i = 0; i < active.size(); ++i) {
+            const size_t query = active[i];
+            const double distance = distances[i];
+            const double maxDistance = maxDistances[query];
+
+            if (distance <= maxDistance) {
+                for (size_t j = 0; j < node.Size && results[query].size() < limit; ++j) {
+                    results[query].push_back(node.Items[j]);
+                }
+            }
+
+            if (node.Radius >= distance + maxDistance) {
+                innerActive.push_back(query);
+            } else if (distance > node.Radius + maxDistance) {
+                outerActive.push_back(query);
+            } else {
+                innerActive.push_back(query);
+                outerActive.push_back(query);
+            }
+        }
+
+        FindNearbyItems(*node.Inner, items, maxDistances, innerActive, results, limit);
+        FindNearbyItems(*node.Outer, items, maxDistances, outerActive, results, limit);
+    }
 };